@@ -0,0 +1,163 @@
+#pragma once
+
+#include <bps3D.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+
+namespace bps3D {
+namespace bench {
+
+// Command line of the benchmarks: positional arguments, starting with
+// scene batch_size res, mixed in any order with flags from valid_flags.
+// Exits with the usage string on anything else.
+class BenchArgs {
+public:
+    BenchArgs(int argc,
+              char *argv[],
+              const char *usage,
+              uint32_t min_positional,
+              uint32_t max_positional,
+              std::initializer_list<const char *> valid_flags)
+        : program_(argv[0]),
+          usage_(usage),
+          positional_(),
+          flags_()
+    {
+        for (int arg_idx = 1; arg_idx < argc; arg_idx++) {
+            const char *arg = argv[arg_idx];
+            if (strncmp(arg, "--", 2) != 0) {
+                positional_.push_back(arg);
+                continue;
+            }
+
+            bool valid = false;
+            for (const char *flag : valid_flags) {
+                valid |= !strcmp(arg, flag);
+            }
+
+            if (!valid) {
+                std::cerr << "Unknown flag " << arg << std::endl;
+                usageExit();
+            }
+
+            flags_.push_back(arg);
+        }
+
+        if (positional_.size() < min_positional ||
+            positional_.size() > max_positional) {
+            usageExit();
+        }
+    }
+
+    inline const char *getScenePath() const { return positional_[0]; }
+    inline uint32_t getBatchSize() const { return getUint(1, 0); }
+    inline uint32_t getResolution() const { return getUint(2, 0); }
+
+    // default_val is returned when the argument is missing
+    uint32_t getUint(uint32_t idx, uint32_t default_val) const
+    {
+        if (idx >= positional_.size()) {
+            return default_val;
+        }
+
+        const char *arg = positional_[idx];
+        char *end;
+        unsigned long val = strtoul(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0') {
+            std::cerr << "Expected a number, got " << arg << std::endl;
+            usageExit();
+        }
+
+        return val;
+    }
+
+    bool hasFlag(const char *flag) const
+    {
+        for (const char *set_flag : flags_) {
+            if (!strcmp(set_flag, flag)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    [[noreturn]] void usageExit() const
+    {
+        std::cerr << program_ << " " << usage_ << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+private:
+    const char *program_;
+    const char *usage_;
+    std::vector<const char *> positional_;
+    std::vector<const char *> flags_;
+};
+
+inline glm::mat4 defaultView()
+{
+    return glm::inverse(glm::mat4(-1.19209e-07, 0, 1, 0, 0, 1, 0, 0, -1, 0,
+                                  -1.19209e-07, 0, -3.38921, 1.62114,
+                                  -3.34509, 1));
+}
+
+// Batches kept in flight, given by the positional argument at idx
+inline uint32_t getDepth(const BenchArgs &args,
+                         uint32_t idx,
+                         uint32_t default_depth)
+{
+    uint32_t depth = args.getUint(idx, default_depth);
+    if (depth == 0) {
+        std::cerr << "depth must be at least 1" << std::endl;
+        args.usageExit();
+    }
+
+    return depth;
+}
+
+// Renders num_frames environments worth of batches, keeping depth of them
+// in flight, and returns the frames per second. Each env's camera is set
+// before every batch, since unchanged envs would be skipped, leaving
+// nothing to cull or draw.
+inline double renderPipelined(Renderer &renderer,
+                              std::vector<Environment> &envs,
+                              const glm::mat4 &view,
+                              uint32_t depth,
+                              uint32_t num_frames)
+{
+    uint32_t num_iters = num_frames / envs.size();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < num_iters; i++) {
+        for (Environment &env : envs) {
+            env.setCameraView(view);
+        }
+
+        uint32_t batch_idx = renderer.render(envs.data());
+        if (i + 1 >= depth) {
+            renderer.waitForFrame((batch_idx + 1) % depth);
+        }
+    }
+
+    for (uint32_t batch_idx = 0; batch_idx < depth; batch_idx++) {
+        renderer.waitForFrame(batch_idx);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    auto diff =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    return (double)num_iters * (double)envs.size() /
+           (double)diff.count() * 1000.0;
+}
+
+}
+}
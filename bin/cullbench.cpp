@@ -0,0 +1,47 @@
+#include <bps3D.hpp>
+#include <iostream>
+#include <cstdlib>
+
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bps3D;
+
+constexpr uint32_t num_frames = 1000000;
+
+int main(int argc, char *argv[])
+{
+    bench::BenchArgs args(argc, argv, "scene batch_size res [depth] [--sync]",
+                          3, 4, {"--sync"});
+
+    uint32_t batch_size = args.getBatchSize();
+    uint32_t res = args.getResolution();
+    uint32_t depth = bench::getDepth(args, 3, 2);
+    bool sync_cull = args.hasFlag("--sync");
+
+    glm::mat4 init_view = bench::defaultView();
+
+    RenderConfig cfg {0, 1, batch_size, res, res, false, RenderMode::UnlitRGB};
+    cfg.numInFlightBatches = depth;
+    cfg.asyncCompute = !sync_cull;
+
+    Renderer renderer(cfg);
+
+    auto loader = renderer.makeLoader();
+    auto scene = loader.loadScene(args.getScenePath());
+
+    vector<Environment> envs;
+
+    for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        envs.emplace_back(renderer.makeEnvironment(scene, init_view));
+    }
+
+    // Culling for each batch can only overlap drawing of the previous one
+    // when more than one batch is in flight
+    double fps =
+        bench::renderPipelined(renderer, envs, init_view, depth, num_frames);
+
+    cout << (sync_cull ? "Graphics queue" : "Async compute")
+         << " culling, Batch size " << batch_size << ", Resolution " << res
+         << ", Depth " << depth << ", FPS: " << fps << endl;
+}
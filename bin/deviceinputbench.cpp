@@ -0,0 +1,171 @@
+#include <bps3D.hpp>
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bps3D;
+
+constexpr uint32_t num_frames = 100000;
+
+static void checkCuda(cudaError_t res, const char *msg)
+{
+    if (res != cudaSuccess) {
+        cerr << msg << ": " << cudaGetErrorString(res) << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Inputs are only uploaded from the host here, but go through the same
+// exported buffer and semaphore a CUDA producer would write and signal
+int main(int argc, char *argv[])
+{
+    bench::BenchArgs args(argc, argv, "scene batch_size res [--host]", 3, 3,
+                          {"--host"});
+
+    uint32_t batch_size = args.getBatchSize();
+    uint32_t res = args.getResolution();
+    bool host_inputs = args.hasFlag("--host");
+
+    glm::mat4 init_view = bench::defaultView();
+
+    RenderConfig cfg {0, 1, batch_size, res, res, false, RenderMode::UnlitRGB};
+    cfg.deviceInputs = true;
+
+    Renderer renderer(cfg);
+
+    auto loader = renderer.makeLoader();
+    auto scene = loader.loadScene(args.getScenePath());
+
+    // A fresh environment holds the scene's default instance layout
+    Environment env = renderer.makeEnvironment(scene, init_view);
+    const auto &env_transforms = env.getTransforms();
+    const auto &env_materials = env.getMaterials();
+    uint32_t num_instances = env_transforms.size();
+
+    vector<shared_ptr<Scene>> scenes(batch_size, scene);
+    vector<glm::mat4> views(batch_size, env.getCamera().worldToCamera);
+    vector<glm::mat4> projs(batch_size, env.getCamera().proj);
+    vector<uint32_t> offsets(batch_size);
+    vector<glm::mat4x3> transforms;
+    vector<uint32_t> materials;
+    vector<glm::mat4> cameras;
+    transforms.reserve(num_instances * batch_size);
+    materials.reserve(num_instances * batch_size);
+    cameras.reserve(2 * batch_size);
+    for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        offsets[batch_idx] = transforms.size();
+        transforms.insert(transforms.end(), env_transforms.begin(),
+                          env_transforms.end());
+        materials.insert(materials.end(), env_materials.begin(),
+                         env_materials.end());
+        cameras.push_back(projs[batch_idx]);
+        cameras.push_back(views[batch_idx]);
+    }
+
+    cudaExternalSemaphoreHandleDesc sema_desc {};
+    sema_desc.type = cudaExternalSemaphoreHandleTypeTimelineSemaphoreFd;
+    sema_desc.handle.fd = renderer.getInputSemaphoreFD();
+
+    cudaExternalSemaphore_t input_sema;
+    checkCuda(cudaImportExternalSemaphore(&input_sema, &sema_desc),
+              "Failed to import input semaphore");
+
+    cudaStream_t strm;
+    checkCuda(cudaStreamCreate(&strm), "Failed to create stream");
+
+    uint64_t inputs_ready = 0;
+
+    auto renderFrame = [&](bool from_host) {
+        RawBatch batch {
+            batch_size,
+            scenes.data(),
+            views.data(),
+            projs.data(),
+            offsets.data(),
+            transforms.data(),
+            nullptr,
+            0,
+        };
+
+        if (!from_host) {
+            DeviceInputs dev_inputs = renderer.getDeviceInputs();
+            checkCuda(cudaMemcpyAsync(dev_inputs.transforms,
+                                      transforms.data(),
+                                      sizeof(glm::mat4x3) * transforms.size(),
+                                      cudaMemcpyHostToDevice, strm),
+                      "Failed to copy transforms");
+            // Materials must be written too, rather than relying on what
+            // an earlier host frame left in the buffer
+            if (dev_inputs.materials) {
+                checkCuda(cudaMemcpyAsync(dev_inputs.materials,
+                                          materials.data(),
+                                          sizeof(uint32_t) * materials.size(),
+                                          cudaMemcpyHostToDevice, strm),
+                          "Failed to copy materials");
+            }
+            checkCuda(cudaMemcpyAsync(dev_inputs.cameras, cameras.data(),
+                                      sizeof(glm::mat4) * cameras.size(),
+                                      cudaMemcpyHostToDevice, strm),
+                      "Failed to copy cameras");
+
+            cudaExternalSemaphoreSignalParams signal_params {};
+            signal_params.params.fence.value = ++inputs_ready;
+            checkCuda(cudaSignalExternalSemaphoresAsync(
+                          &input_sema, &signal_params, 1, strm),
+                      "Failed to signal input semaphore");
+
+            batch.views = nullptr;
+            batch.transforms = nullptr;
+            batch.inputsReadyValue = inputs_ready;
+        }
+
+        renderer.renderRaw(batch);
+        renderer.waitForFrame();
+    };
+
+    // Both paths must produce the same images
+    uint64_t output_bytes = (uint64_t)batch_size * res * res * 4;
+    vector<uint8_t> host_output(output_bytes);
+    vector<uint8_t> device_output(output_bytes);
+
+    renderFrame(true);
+    checkCuda(cudaMemcpy(host_output.data(), renderer.getColorPointer(),
+                         output_bytes, cudaMemcpyDeviceToHost),
+              "Failed to read output");
+
+    renderFrame(false);
+    checkCuda(cudaMemcpy(device_output.data(), renderer.getColorPointer(),
+                         output_bytes, cudaMemcpyDeviceToHost),
+              "Failed to read output");
+
+    if (host_output != device_output) {
+        cerr << "Device inputs rendered different images" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    uint32_t num_iters = num_frames / batch_size;
+
+    for (uint32_t i = 0; i < num_iters; i++) {
+        renderFrame(host_inputs);
+    }
+
+    auto end = chrono::steady_clock::now();
+
+    auto diff = chrono::duration_cast<chrono::milliseconds>(end - start);
+    cout << (host_inputs ? "Host" : "Device") << " inputs, Batch size "
+         << batch_size << ", Resolution " << res << ", FPS: "
+         << ((double)num_iters * (double)batch_size / (double)diff.count()) *
+                1000.0
+         << endl;
+
+    cudaDestroyExternalSemaphore(input_sema);
+    cudaStreamDestroy(strm);
+}
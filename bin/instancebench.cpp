@@ -0,0 +1,86 @@
+#include <bps3D.hpp>
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+
+#include <glm/gtx/transform.hpp>
+
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bps3D;
+
+constexpr uint32_t num_frames = 100000;
+
+int main(int argc, char *argv[])
+{
+    bench::BenchArgs args(argc, argv,
+                          "scene batch_size res num_updates [--host]", 4, 4,
+                          {"--host"});
+
+    uint32_t batch_size = args.getBatchSize();
+    uint32_t res = args.getResolution();
+    uint32_t num_updates = args.getUint(3, 0);
+    bool host_instances = args.hasFlag("--host");
+
+    glm::mat4 init_view = bench::defaultView();
+
+    RenderConfig cfg {0, 1, batch_size, res, res, false, RenderMode::UnlitRGB};
+    cfg.hostVisibleInstances = host_instances;
+
+    Renderer renderer(cfg);
+
+    auto loader = renderer.makeLoader();
+    auto scene = loader.loadScene(args.getScenePath());
+
+    vector<Environment> envs;
+
+    for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        envs.emplace_back(renderer.makeEnvironment(scene, init_view));
+    }
+
+    // Default instance IDs are contiguous from 0
+    uint32_t num_instances = 0;
+    for (const InstanceRange &range : envs[0].getInstanceRanges()) {
+        num_instances += range.count;
+    }
+
+    if (num_instances == 0) {
+        cerr << "Scene has no instances to update" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    mt19937 rng(0);
+    uniform_int_distribution<uint32_t> inst_dist(0, num_instances - 1);
+    uniform_real_distribution<float> offset_dist(-0.01f, 0.01f);
+
+    auto start = chrono::steady_clock::now();
+
+    uint32_t num_iters = num_frames / batch_size;
+
+    for (uint32_t i = 0; i < num_iters; i++) {
+        for (Environment &env : envs) {
+            for (uint32_t j = 0; j < num_updates; j++) {
+                uint32_t inst_id = inst_dist(rng);
+                glm::mat4x3 txfm = env.getInstanceTransform(inst_id);
+                txfm[3] += glm::vec3(offset_dist(rng), offset_dist(rng),
+                                     offset_dist(rng));
+                env.updateInstanceTransform(inst_id, txfm);
+            }
+        }
+
+        renderer.render(envs.data());
+        renderer.waitForFrame();
+    }
+
+    auto end = chrono::steady_clock::now();
+
+    auto diff = chrono::duration_cast<chrono::milliseconds>(end - start);
+    cout << (host_instances ? "Host-visible" : "Device-local")
+         << " instances, Batch size " << batch_size << ", Resolution " << res
+         << ", Updates per env " << num_updates << ", FPS: "
+         << ((double)num_iters * (double)batch_size / (double)diff.count()) *
+                1000.0
+         << endl;
+}
@@ -0,0 +1,48 @@
+#include <bps3D.hpp>
+#include <iostream>
+#include <cstdlib>
+
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bps3D;
+
+constexpr uint32_t num_frames = 1000000;
+
+int main(int argc, char *argv[])
+{
+    bench::BenchArgs args(argc, argv,
+                          "scene batch_size res [depth] [--single]", 3, 4,
+                          {"--single"});
+
+    uint32_t batch_size = args.getBatchSize();
+    uint32_t res = args.getResolution();
+    uint32_t depth = bench::getDepth(args, 3, 2);
+    bool single_queue = args.hasFlag("--single");
+
+    glm::mat4 init_view = bench::defaultView();
+
+    RenderConfig cfg {0, 1, batch_size, res, res, false, RenderMode::UnlitRGB};
+    cfg.numInFlightBatches = depth;
+    cfg.multiQueue = !single_queue;
+
+    Renderer renderer(cfg);
+
+    auto loader = renderer.makeLoader();
+    auto scene = loader.loadScene(args.getScenePath());
+
+    vector<Environment> envs;
+
+    for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        envs.emplace_back(renderer.makeEnvironment(scene, init_view));
+    }
+
+    // Consecutive batches land on different graphics queues, so they can
+    // only render concurrently when more than one batch is in flight
+    double fps =
+        bench::renderPipelined(renderer, envs, init_view, depth, num_frames);
+
+    cout << (single_queue ? "Single" : "Multi") << " queue rendering"
+         << ", Batch size " << batch_size << ", Resolution " << res
+         << ", Depth " << depth << ", FPS: " << fps << endl;
+}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <chrono>
+#include <cstring>
 #include <fstream>
 
 using namespace std;
@@ -32,23 +33,36 @@ vector<glm::mat4> readViews(const char *dump_path)
 int main(int argc, char *argv[])
 {
     if (argc < 4) {
-        cerr << argv[0] << " scene batch_size res views" << endl;
+        cerr << argv[0] << " scene batch_size res [views] [--depth depth]"
+             << endl;
         exit(EXIT_FAILURE);
     }
 
     uint32_t batch_size = stoul(argv[2]);
     uint32_t res = stoul(argv[3]);
+    uint32_t depth = 1;
+    const char *views_path = nullptr;
+    for (int arg_idx = 4; arg_idx < argc; arg_idx++) {
+        if (!strcmp(argv[arg_idx], "--depth") && arg_idx + 1 < argc) {
+            depth = stoul(argv[++arg_idx]);
+        } else {
+            views_path = argv[arg_idx];
+        }
+    }
+
     vector<glm::mat4> init_views;
-    if (argc > 4) {
-        init_views = readViews(argv[4]);
+    if (views_path) {
+        init_views = readViews(views_path);
     } else {
         init_views = {glm::inverse(glm::mat4(-1.19209e-07, 0, 1, 0, 0, 1, 0, 0,
                                              -1, 0, -1.19209e-07, 0, -3.38921,
                                              1.62114, -3.34509, 1))};
     }
 
-    Renderer renderer(
-        {0, 1, batch_size, res, res, false, RenderMode::UnlitRGB});
+    RenderConfig cfg {0, 1, batch_size, res, res, false, RenderMode::UnlitRGB};
+    cfg.numInFlightBatches = depth;
+
+    Renderer renderer(cfg);
 
     auto loader = renderer.makeLoader();
     auto scene = loader.loadScene(argv[1]);
@@ -71,14 +85,22 @@ int main(int argc, char *argv[])
                 init_views[(cur_view++) % init_views.size()]);
         }
 
-        renderer.render(envs.data());
-        renderer.waitForFrame();
+        // Keep depth batches in flight, only waiting for the oldest
+        uint32_t batch_idx = renderer.render(envs.data());
+        if (i + 1 >= depth) {
+            renderer.waitForFrame((batch_idx + 1) % depth);
+        }
+    }
+
+    for (uint32_t batch_idx = 0; batch_idx < depth; batch_idx++) {
+        renderer.waitForFrame(batch_idx);
     }
 
     auto end = chrono::steady_clock::now();
 
     auto diff = chrono::duration_cast<chrono::milliseconds>(end - start);
-    cout << "Batch size " << batch_size << ", Resolution " << res << ", FPS: "
+    cout << "Batch size " << batch_size << ", Resolution " << res
+         << ", Depth " << depth << ", FPS: "
          << ((double)num_iters * (double)batch_size / (double)diff.count()) *
                 1000.0
          << endl;
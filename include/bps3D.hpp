@@ -6,6 +6,7 @@
 #include <bps3D/utils.hpp>
 #include <bps3D/environment.hpp>
 
+#include <functional>
 #include <string_view>
 
 namespace bps3D {
@@ -48,13 +49,82 @@ public:
 
     uint32_t render(const Environment *envs);
 
+    // Only render the first num_envs environments. Slots past num_envs
+    // are skipped entirely and envs is not read for them.
+    uint32_t render(const Environment *envs, uint32_t num_envs);
+
+    // Only render environments whose active flag is set. envs must still
+    // have batchSize entries, but inactive ones are never read.
+    uint32_t renderActive(const Environment *envs, const bool *active);
+
+    // Renders inputs the caller already holds as flat arrays, without
+    // going through Environments. Slots past batch.numEnvs are inactive.
+    // Raw environments have no lights and are never skipped.
+    uint32_t renderRaw(const RawBatch &batch);
+
+    // Alternatively a batch can be built up slot by slot from many
+    // threads, each packing its own environment's render inputs as soon as
+    // it is ready rather than all of them being packed by render().
+    // beginBatch waits for the batch's previous render to finish.
+    void beginBatch();
+
+    // Thread safe. Reserves the next unused slot of the batch being built,
+    // for callers without a fixed slot per environment. Don't mix with
+    // setting slots chosen by the caller.
+    uint32_t claimSlot();
+
+    // Thread safe, as long as each slot is only set once per batch. env
+    // must stay alive and unchanged until submitBatch returns.
+    void setEnvironment(uint32_t slot, const Environment &env);
+
+    // Renders the batch being built, like render(). Slots that were never
+    // set are inactive.
+    uint32_t submitBatch();
+
     void waitForFrame(uint32_t batch_idx = 0);
 
+    // Returns whether the batch's most recent render has finished,
+    // without blocking
+    bool isFrameReady(uint32_t batch_idx = 0);
+
+    // eventfd that becomes readable each time the batch finishes
+    // rendering, for use with poll / epoll. Read it to clear it.
+    int getFrameReadyFD(uint32_t batch_idx = 0);
+
+    // Called from an internal thread with the batch index as each batch
+    // finishes rendering, in submission order
+    void setFrameCallback(std::function<void(uint32_t)> cb);
+
     uint8_t *getColorPointer(uint32_t batch_idx = 0);
     float *getDepthPointer(uint32_t batch_idx = 0);
 
+    // Number of active environments the batch's most recent render
+    // skipped, because nothing about them changed since that batch last
+    // rendered them. Their previous output is left in place.
+    uint32_t getNumSkipped(uint32_t batch_idx = 0);
+
+    // Where the batch's inputs live on the GPU, with deviceInputs set.
+    // Batches are rendered in turn starting from 0, so the inputs of the
+    // next batch can be written once its previous render finished.
+    DeviceInputs getDeviceInputs(uint32_t batch_idx = 0);
+
+    // Opaque fd of the timeline semaphore renderRaw waits on before
+    // reading device inputs, for cudaImportExternalSemaphore. Each call
+    // returns a new fd owned by the caller.
+    int getInputSemaphoreFD();
+
+    // Switches to a new batch size, resolution, number of in flight
+    // batches or other per-frame option, after waiting for all submitted
+    // batches. Loaders, loaded scenes and environments stay valid, so
+    // gpuID, numLoaders, mode and deviceInputs must be unchanged. Output
+    // pointers, device input pointers, frame ready FDs and the frame
+    // callback are invalidated, and existing environments keep their
+    // camera's aspect ratio.
+    void reconfigure(const RenderConfig &cfg);
+
 private:
     RendererImpl backend_;
+    uint32_t batch_size_;
     float aspect_ratio_;
 };
 
@@ -6,6 +6,7 @@
 
 #include <cuda_fp16.h>
 
+#include <functional>
 #include <memory>
 #include <string_view>
 
@@ -14,11 +15,13 @@ namespace bps3D {
 class EnvironmentImpl {
 public:
     typedef void (*DestroyType)(EnvironmentBackend *);
+    typedef EnvironmentBackend *(*CloneType)(const EnvironmentBackend *);
     typedef uint32_t (EnvironmentBackend::*AddLightType)(const glm::vec3 &,
                                                          const glm::vec3 &);
     typedef void (EnvironmentBackend::*RemoveLightType)(uint32_t);
 
     EnvironmentImpl(DestroyType destroy_ptr,
+                    CloneType clone_ptr,
                     AddLightType add_light_ptr,
                     RemoveLightType remove_light_ptr,
                     EnvironmentBackend *state);
@@ -30,6 +33,8 @@ public:
 
     ~EnvironmentImpl();
 
+    EnvironmentImpl clone() const;
+
     inline uint32_t addLight(const glm::vec3 &position,
                              const glm::vec3 &color);
     inline void removeLight(uint32_t idx);
@@ -39,6 +44,7 @@ public:
 
 private:
     DestroyType destroy_ptr_;
+    CloneType clone_ptr_;
     AddLightType add_light_ptr_;
     RemoveLightType remove_light_ptr_;
     EnvironmentBackend *state_;
@@ -76,18 +82,47 @@ public:
     typedef EnvironmentImpl (RenderBackend::*MakeEnvironmentType)(
         const Camera &cam,
         const std::shared_ptr<Scene> &);
-    typedef uint32_t (RenderBackend::*RenderType)(const Environment *);
+    typedef uint32_t (RenderBackend::*RenderType)(const Environment *,
+                                                  uint32_t,
+                                                  const bool *);
+    typedef uint32_t (RenderBackend::*RenderRawType)(const RawBatch &);
+    typedef void (RenderBackend::*BeginBatchType)();
+    typedef uint32_t (RenderBackend::*ClaimSlotType)();
+    typedef void (RenderBackend::*SetEnvironmentType)(uint32_t,
+                                                      const Environment &);
+    typedef uint32_t (RenderBackend::*SubmitBatchType)();
     typedef void (RenderBackend::*WaitType)(uint32_t frame_idx);
+    typedef bool (RenderBackend::*IsReadyType)(uint32_t frame_idx);
+    typedef int (RenderBackend::*GetReadyFDType)(uint32_t frame_idx);
+    typedef void (RenderBackend::*SetCallbackType)(
+        std::function<void(uint32_t)> &&);
     typedef uint8_t *(RenderBackend::*GetColorType)(uint32_t frame_idx);
     typedef float *(RenderBackend::*GetDepthType)(uint32_t frame_idx);
+    typedef uint32_t (RenderBackend::*GetNumSkippedType)(uint32_t frame_idx);
+    typedef DeviceInputs (RenderBackend::*GetDeviceInputsType)(
+        uint32_t frame_idx);
+    typedef int (RenderBackend::*GetInputSemaphoreFDType)();
+    typedef void (RenderBackend::*ReconfigureType)(const RenderConfig &);
 
     RendererImpl(DestroyType destroy_ptr,
                  MakeLoaderType make_loader_ptr,
                  MakeEnvironmentType make_env_ptr,
                  RenderType render_ptr,
+                 RenderRawType render_raw_ptr,
+                 BeginBatchType begin_batch_ptr,
+                 ClaimSlotType claim_slot_ptr,
+                 SetEnvironmentType set_env_ptr,
+                 SubmitBatchType submit_batch_ptr,
                  WaitType wait_ptr,
+                 IsReadyType is_ready_ptr,
+                 GetReadyFDType get_ready_fd_ptr,
+                 SetCallbackType set_callback_ptr,
                  GetColorType get_color_ptr,
                  GetDepthType get_depth_ptr,
+                 GetNumSkippedType get_num_skipped_ptr,
+                 GetDeviceInputsType get_device_inputs_ptr,
+                 GetInputSemaphoreFDType get_input_semaphore_fd_ptr,
+                 ReconfigureType reconfigure_ptr,
                  RenderBackend *state);
     RendererImpl(const RendererImpl &) = delete;
     RendererImpl(RendererImpl &&);
@@ -103,21 +138,49 @@ public:
         const Camera &cam,
         const std::shared_ptr<Scene> &scene) const;
 
-    inline uint32_t render(const Environment *envs);
+    inline uint32_t render(const Environment *envs,
+                           uint32_t num_envs,
+                           const bool *active);
+    inline uint32_t renderRaw(const RawBatch &batch);
+
+    inline void beginBatch();
+    inline uint32_t claimSlot();
+    inline void setEnvironment(uint32_t slot, const Environment &env);
+    inline uint32_t submitBatch();
 
     inline void waitForFrame(uint32_t frame_idx);
+    inline bool isFrameReady(uint32_t frame_idx);
+    inline int getFrameReadyFD(uint32_t frame_idx);
+    inline void setFrameCallback(std::function<void(uint32_t)> &&cb);
 
     inline uint8_t *getColorPointer(uint32_t frame_idx);
     inline float *getDepthPointer(uint32_t frame_idx);
+    inline uint32_t getNumSkipped(uint32_t frame_idx);
+    inline DeviceInputs getDeviceInputs(uint32_t frame_idx);
+    inline int getInputSemaphoreFD();
+
+    inline void reconfigure(const RenderConfig &cfg);
 
 private:
     DestroyType destroy_ptr_;
     MakeLoaderType make_loader_ptr_;
     MakeEnvironmentType make_env_ptr_;
     RenderType render_ptr_;
+    RenderRawType render_raw_ptr_;
+    BeginBatchType begin_batch_ptr_;
+    ClaimSlotType claim_slot_ptr_;
+    SetEnvironmentType set_env_ptr_;
+    SubmitBatchType submit_batch_ptr_;
     WaitType wait_ptr_;
+    IsReadyType is_ready_ptr_;
+    GetReadyFDType get_ready_fd_ptr_;
+    SetCallbackType set_callback_ptr_;
     GetColorType get_color_ptr_;
     GetDepthType get_depth_ptr_;
+    GetNumSkippedType get_num_skipped_ptr_;
+    GetDeviceInputsType get_device_inputs_ptr_;
+    GetInputSemaphoreFDType get_input_semaphore_fd_ptr_;
+    ReconfigureType reconfigure_ptr_;
     RenderBackend *state_;
 };
 
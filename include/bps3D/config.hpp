@@ -22,6 +22,37 @@ struct RenderConfig {
     uint32_t imgHeight;
     bool doubleBuffered;
     RenderMode mode;
+
+    // Number of batches that can be in flight at once. render() cycles
+    // through them, so waitForFrame only needs to be called before a
+    // batch's output is read. 0 picks 1 or 2 based on doubleBuffered.
+    uint32_t numInFlightBatches = 0;
+
+    // Have shaders read instance transforms and material indices straight
+    // from host-visible memory rather than from device-local copies.
+    // Mostly useful for benchmarking.
+    bool hostVisibleInstances = false;
+
+    // Zero the output images of environments skipped by render() rather
+    // than leaving whatever was last rendered into them
+    bool zeroInactiveOutputs = false;
+
+    // Cull on a dedicated compute queue, so culling for one batch overlaps
+    // drawing of the previous one. Disabling this runs everything on the
+    // graphics queue, which is mostly useful for benchmarking.
+    bool asyncCompute = true;
+
+    // Alternate batches between the device's graphics queues, so with
+    // more than one batch in flight consecutive batches can render
+    // concurrently. Disabling this renders everything on one graphics
+    // queue, which is mostly useful for benchmarking.
+    bool multiQueue = true;
+
+    // Export each batch's instance transforms, material indices and
+    // cameras to CUDA, so renderRaw can consume ones written on the GPU
+    // without a round trip through host memory. Implies device-local
+    // instances.
+    bool deviceInputs = false;
 };
 
 inline constexpr RenderMode &operator|=(RenderMode &a, RenderMode b)
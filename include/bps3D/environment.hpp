@@ -5,6 +5,8 @@
 #include <bps3D/utils.hpp>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <memory>
 #include <vector>
 
 namespace bps3D {
@@ -38,6 +40,68 @@ struct Camera {
     glm::mat4 proj;
 };
 
+// Change counters for each category of environment state. Backends
+// compare these against the values they last uploaded so that state
+// which hasn't changed since the previous frame isn't repacked.
+struct EnvironmentVersion {
+    uint32_t topology;
+    uint32_t transforms;
+    uint32_t materials;
+    uint32_t lights;
+    uint32_t camera;
+};
+
+// Instances of one model occupy a contiguous range of an environment's
+// instance arena. Entries past count are spare capacity and unused.
+struct InstanceRange {
+    uint32_t offset;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+// Render inputs for a whole batch, given directly as flat arrays rather
+// than through Environments. Each environment's instances are laid out
+// like the instance arena of a newly made Environment of its scene, that
+// is the scene's default instances sorted by model.
+struct RawBatch {
+    // Environments fill the first numEnvs slots of the batch
+    uint32_t numEnvs;
+    const std::shared_ptr<Scene> *scenes;
+
+    // World to camera and projection matrix of each environment. With
+    // device inputs, null views means the batch's cameras were already
+    // written to device memory. Projections are always needed for
+    // culling, and must match the ones written there.
+    const glm::mat4 *views;
+    const glm::mat4 *projections;
+
+    // Start of each environment's instances in transforms and materials.
+    // Batches where environments follow each other without gaps are
+    // copied in bulk. With device inputs, null transforms means the
+    // batch's transforms and materials were already written to device
+    // memory, without gaps, and both offsets and materials are ignored.
+    const uint32_t *instanceOffsets;
+    const glm::mat4x3 *transforms;
+    // Optional, the scene's default materials are used when null
+    const uint32_t *materials;
+
+    // With device inputs, the batch isn't read on the GPU until the input
+    // semaphore reaches this value
+    uint64_t inputsReadyValue;
+};
+
+// Device pointers, usable from CUDA, to the render inputs of one of the
+// renderer's batches
+struct DeviceInputs {
+    // Indexed like the arrays of a RawBatch with no gaps between
+    // environments. materials is null if the render mode doesn't use them.
+    glm::mat4x3 *transforms;
+    uint32_t *materials;
+
+    // Projection then world to camera matrix of each slot
+    glm::mat4 *cameras;
+};
+
 class Environment {
 public:
     Environment(EnvironmentImpl &&backend,
@@ -50,6 +114,13 @@ public:
     Environment(Environment &&) = default;
     Environment &operator=(Environment &&) = default;
 
+    // Forks the environment, with a new ID. Instance and light tables are
+    // shared with this environment until either one modifies them, so
+    // cloning doesn't copy them. Afterwards the two can be modified from
+    // different threads, but cloning itself must not race with modifying
+    // this environment.
+    Environment clone() const;
+
     // Instance transformations
     inline uint32_t addInstance(uint32_t model_idx,
                                 uint32_t material_idx,
@@ -69,6 +140,20 @@ public:
     inline void updateInstanceTransform(uint32_t inst_id,
                                         const glm::mat4x3 &model_matrix);
 
+    // Bulk versions of updateInstanceTransform, for updating many
+    // instances per step. Each array holds num_updates entries.
+    void updateInstanceTransforms(const uint32_t *inst_ids,
+                                  const glm::mat4x3 *model_matrices,
+                                  uint32_t num_updates);
+
+    // Builds each transform from a position, a unit quaternion and a per
+    // axis scale, which may be null for unscaled instances
+    void updateInstanceTransforms(const uint32_t *inst_ids,
+                                  const glm::vec3 *positions,
+                                  const glm::quat *rotations,
+                                  const glm::vec3 *scales,
+                                  uint32_t num_updates);
+
     inline void setInstanceMaterial(uint32_t inst_id, uint32_t material_idx);
 
     inline void setCameraView(const glm::mat4 &world_to_camera);
@@ -84,26 +169,87 @@ public:
     inline const EnvironmentBackend *getBackend() const;
     inline const Camera &getCamera() const;
 
-    inline const std::vector<std::vector<glm::mat4x3>> &getTransforms() const;
+    // Unique for the lifetime of the process
+    inline uint64_t getID() const;
+    inline const EnvironmentVersion &getVersion() const;
+
+    // Instance arena, sorted by model. The first numModels ranges hold
+    // the scene's default instances, the next numModels ranges hold
+    // instances added with addInstance.
+    inline const std::vector<glm::mat4x3> &getTransforms() const;
+    inline const std::vector<uint32_t> &getMaterials() const;
+    inline const std::vector<InstanceRange> &getInstanceRanges() const;
+
+    // Arena index of each transform / material update since the last
+    // topology change, oldest first. Only the most recent entries are
+    // kept; backends that fall further behind must upload everything.
+    inline const std::vector<uint32_t> &getInstanceUpdates() const;
 
-    inline const std::vector<std::vector<uint32_t>> &getMaterials() const;
+    // Until one of the scene's default instances is modified or deleted,
+    // they fill the start of the arena unchanged, and backends may share a
+    // single copy between all environments. Returns 0 once detached.
+    inline uint32_t getNumSharedInstances() const;
+    inline bool sharesStaticInstances() const;
 
 private:
+    // Instance and light tables start out as the scene's own copy, and
+    // each environment sharing one copies it before first modifying it.
+    // Ownership is tracked explicitly rather than through the reference
+    // count, which can't order a write in place on one thread against
+    // another thread still copying the table.
+    template <typename T>
+    struct SharedTable {
+        inline const std::vector<T> &operator*() const { return *data; }
+        inline const std::vector<T> *operator->() const
+        {
+            return data.get();
+        }
+
+        std::shared_ptr<std::vector<T>> data;
+        // Only set on a copy made by this environment, which nothing else
+        // references. Cleared on both sides by clone().
+        mutable bool owned;
+    };
+
+    template <typename T>
+    static inline std::vector<T> &makeUnique(SharedTable<T> &table);
+
+    template <typename T>
+    static inline SharedTable<T> shareTable(const SharedTable<T> &table);
+
+    Environment(EnvironmentImpl &&backend, const Environment &o);
+
+    void detachStaticInstances();
+    void growInstanceRange(uint32_t range_idx);
+    inline void logInstanceUpdate(uint32_t arena_idx);
+    const uint32_t *logInstanceUpdates(const uint32_t *inst_ids,
+                                       uint32_t num_updates);
+
     EnvironmentImpl backend_;
     std::shared_ptr<Scene> scene_;
 
     Camera camera_;
 
-    std::vector<std::vector<glm::mat4x3>> transforms_;
-    std::vector<std::vector<uint32_t>> materials_;
+    uint64_t id_;
+    EnvironmentVersion version_;
 
-    std::vector<std::pair<uint32_t, uint32_t>> index_map_;
-    std::vector<std::vector<uint32_t>> reverse_id_map_;
+    SharedTable<glm::mat4x3> transforms_;
+    SharedTable<uint32_t> materials_;
+    SharedTable<InstanceRange> ranges_;
+
+    // ID -> (range, arena index) and arena index -> ID
+    SharedTable<std::pair<uint32_t, uint32_t>> index_map_;
+    SharedTable<uint32_t> reverse_id_map_;
     std::vector<uint32_t> free_ids_;
 
+    std::vector<uint32_t> update_log_;
+
+    // Default instances have IDs [0, num_static_instances_) while shared
+    uint32_t num_static_instances_;
+
     std::vector<uint32_t> free_light_ids_;
-    std::vector<uint32_t> light_ids_;
-    std::vector<uint32_t> light_reverse_ids_;
+    SharedTable<uint32_t> light_ids_;
+    SharedTable<uint32_t> light_reverse_ids_;
 };
 
 }
@@ -82,6 +82,26 @@ void Camera::updateView(const glm::vec3 &position,
     worldToCamera = CameraHelper::makeViewMatrix(position, fwd, up, right);
 }
 
+template <typename T>
+std::vector<T> &Environment::makeUnique(SharedTable<T> &table)
+{
+    if (!table.owned) {
+        table.data = std::make_shared<std::vector<T>>(*table.data);
+        table.owned = true;
+    }
+
+    return *table.data;
+}
+
+template <typename T>
+Environment::SharedTable<T> Environment::shareTable(
+    const SharedTable<T> &table)
+{
+    table.owned = false;
+
+    return SharedTable<T> {table.data, false};
+}
+
 uint32_t Environment::addInstance(uint32_t model_idx,
                                   uint32_t material_idx,
                                   const glm::mat4x4 &matrix)
@@ -91,15 +111,20 @@ uint32_t Environment::addInstance(uint32_t model_idx,
 
 const glm::mat4x3 &Environment::getInstanceTransform(uint32_t inst_id) const
 {
-    const auto &p = index_map_[inst_id];
-    return transforms_[p.first][p.second];
+    return (*transforms_)[(*index_map_)[inst_id].second];
 }
 
 void Environment::updateInstanceTransform(uint32_t inst_id,
                                           const glm::mat4x3 &mat)
 {
-    const auto &p = index_map_[inst_id];
-    transforms_[p.first][p.second] = mat;
+    if (inst_id < num_static_instances_) {
+        detachStaticInstances();
+    }
+
+    uint32_t arena_idx = (*index_map_)[inst_id].second;
+    makeUnique(transforms_)[arena_idx] = mat;
+    version_.transforms++;
+    logInstanceUpdate(arena_idx);
 }
 
 void Environment::updateInstanceTransform(uint32_t inst_id,
@@ -110,13 +135,20 @@ void Environment::updateInstanceTransform(uint32_t inst_id,
 
 void Environment::setInstanceMaterial(uint32_t inst_id, uint32_t material_idx)
 {
-    const auto &p = index_map_[inst_id];
-    materials_[p.first][p.second] = material_idx;
+    if (inst_id < num_static_instances_) {
+        detachStaticInstances();
+    }
+
+    uint32_t arena_idx = (*index_map_)[inst_id].second;
+    makeUnique(materials_)[arena_idx] = material_idx;
+    version_.materials++;
+    logInstanceUpdate(arena_idx);
 }
 
 void Environment::setCameraView(const glm::mat4 &world_to_camera)
 {
     camera_.updateView(world_to_camera);
+    version_.camera++;
 }
 
 void Environment::setCameraView(const glm::vec3 &position,
@@ -125,6 +157,7 @@ void Environment::setCameraView(const glm::vec3 &position,
                                 const glm::vec3 &right)
 {
     camera_.updateView(position, fwd, up, right);
+    version_.camera++;
 }
 
 const std::shared_ptr<Scene> Environment::getScene() const
@@ -142,14 +175,57 @@ const Camera &Environment::getCamera() const
     return camera_;
 }
 
-const std::vector<std::vector<glm::mat4x3>> &Environment::getTransforms() const
+uint64_t Environment::getID() const
+{
+    return id_;
+}
+
+const EnvironmentVersion &Environment::getVersion() const
+{
+    return version_;
+}
+
+const std::vector<glm::mat4x3> &Environment::getTransforms() const
 {
-    return transforms_;
+    return *transforms_;
 }
 
-const std::vector<std::vector<uint32_t>> &Environment::getMaterials() const
+const std::vector<uint32_t> &Environment::getMaterials() const
 {
-    return materials_;
+    return *materials_;
+}
+
+const std::vector<InstanceRange> &Environment::getInstanceRanges() const
+{
+    return *ranges_;
+}
+
+const std::vector<uint32_t> &Environment::getInstanceUpdates() const
+{
+    return update_log_;
+}
+
+uint32_t Environment::getNumSharedInstances() const
+{
+    return num_static_instances_;
+}
+
+bool Environment::sharesStaticInstances() const
+{
+    return num_static_instances_ > 0;
+}
+
+void Environment::logInstanceUpdate(uint32_t arena_idx)
+{
+    // Past one entry per instance, a full upload is cheaper than replaying
+    // the log, so drop the older half rather than growing without bound
+    size_t num_instances = index_map_->size() - free_ids_.size();
+    if (update_log_.size() >= num_instances) {
+        update_log_.erase(update_log_.begin(),
+                          update_log_.begin() + (update_log_.size() + 1) / 2);
+    }
+
+    update_log_.push_back(arena_idx);
 }
 
 }
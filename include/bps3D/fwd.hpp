@@ -8,6 +8,9 @@ struct EnvironmentBackend;
 struct LoaderBackend;
 struct RenderBackend;
 struct Camera;
+struct RenderConfig;
+struct RawBatch;
+struct DeviceInputs;
 
 class Environment;
 class AssetLoader;
@@ -5,6 +5,7 @@
 
 #include "vulkan/render.hpp"
 
+#include <atomic>
 #include <functional>
 #include <iostream>
 
@@ -47,6 +48,7 @@ static RendererImpl makeBackend(const RenderConfig &cfg, BackendSelect backend)
 
 Renderer::Renderer(const RenderConfig &cfg, BackendSelect backend)
     : backend_(makeBackend(cfg, backend)),
+      batch_size_(cfg.batchSize),
       aspect_ratio_(float(cfg.imgWidth) / float(cfg.imgHeight))
 {}
 
@@ -95,7 +97,42 @@ Environment Renderer::makeEnvironment(const std::shared_ptr<Scene> &scene,
 
 uint32_t Renderer::render(const Environment *envs)
 {
-    return backend_.render(envs);
+    return backend_.render(envs, batch_size_, nullptr);
+}
+
+uint32_t Renderer::render(const Environment *envs, uint32_t num_envs)
+{
+    return backend_.render(envs, num_envs, nullptr);
+}
+
+uint32_t Renderer::renderActive(const Environment *envs, const bool *active)
+{
+    return backend_.render(envs, batch_size_, active);
+}
+
+uint32_t Renderer::renderRaw(const RawBatch &batch)
+{
+    return backend_.renderRaw(batch);
+}
+
+void Renderer::beginBatch()
+{
+    backend_.beginBatch();
+}
+
+uint32_t Renderer::claimSlot()
+{
+    return backend_.claimSlot();
+}
+
+void Renderer::setEnvironment(uint32_t slot, const Environment &env)
+{
+    backend_.setEnvironment(slot, env);
+}
+
+uint32_t Renderer::submitBatch()
+{
+    return backend_.submitBatch();
 }
 
 void Renderer::waitForFrame(uint32_t batch_idx)
@@ -103,6 +140,21 @@ void Renderer::waitForFrame(uint32_t batch_idx)
     backend_.waitForFrame(batch_idx);
 }
 
+bool Renderer::isFrameReady(uint32_t batch_idx)
+{
+    return backend_.isFrameReady(batch_idx);
+}
+
+int Renderer::getFrameReadyFD(uint32_t batch_idx)
+{
+    return backend_.getFrameReadyFD(batch_idx);
+}
+
+void Renderer::setFrameCallback(function<void(uint32_t)> cb)
+{
+    backend_.setFrameCallback(move(cb));
+}
+
 uint8_t *Renderer::getColorPointer(uint32_t batch_idx)
 {
     return backend_.getColorPointer(batch_idx);
@@ -113,112 +165,351 @@ float *Renderer::getDepthPointer(uint32_t batch_idx)
     return backend_.getDepthPointer(batch_idx);
 }
 
+uint32_t Renderer::getNumSkipped(uint32_t batch_idx)
+{
+    return backend_.getNumSkipped(batch_idx);
+}
+
+DeviceInputs Renderer::getDeviceInputs(uint32_t batch_idx)
+{
+    return backend_.getDeviceInputs(batch_idx);
+}
+
+int Renderer::getInputSemaphoreFD()
+{
+    return backend_.getInputSemaphoreFD();
+}
+
+void Renderer::reconfigure(const RenderConfig &cfg)
+{
+    backend_.reconfigure(cfg);
+
+    batch_size_ = cfg.batchSize;
+    aspect_ratio_ = float(cfg.imgWidth) / float(cfg.imgHeight);
+}
+
+// 0 is never handed out, so backends can use it to mark empty slots
+static atomic_uint64_t next_environment_id(1);
+
 Environment::Environment(EnvironmentImpl &&backend,
                          const Camera &cam,
                          const shared_ptr<Scene> &scene)
     : backend_(move(backend)),
       scene_(scene),
       camera_(cam),
-      transforms_(scene_->envInit.transforms),
-      materials_(scene_->envInit.materials),
-      index_map_(scene_->envInit.indexMap),
-      reverse_id_map_(scene_->envInit.reverseIDMap),
+      id_(next_environment_id.fetch_add(1, memory_order_relaxed)),
+      version_ {},
+      transforms_ {{scene_, &scene_->envInit.transforms}, false},
+      materials_ {{scene_, &scene_->envInit.materials}, false},
+      ranges_ {{scene_, &scene_->envInit.ranges}, false},
+      index_map_ {{scene_, &scene_->envInit.indexMap}, false},
+      reverse_id_map_ {{scene_, &scene_->envInit.reverseIDMap}, false},
       free_ids_(),
+      update_log_(),
+      num_static_instances_(scene_->envInit.indexMap.size()),
       free_light_ids_(),
-      light_ids_(scene_->envInit.lightIDs),
-      light_reverse_ids_(scene_->envInit.lightReverseIDs)
+      light_ids_ {{scene_, &scene_->envInit.lightIDs}, false},
+      light_reverse_ids_ {{scene_, &scene_->envInit.lightReverseIDs}, false}
 {
     // FIXME use EnvironmentInit lights
 }
 
+Environment::Environment(EnvironmentImpl &&backend, const Environment &o)
+    : backend_(move(backend)),
+      scene_(o.scene_),
+      camera_(o.camera_),
+      id_(next_environment_id.fetch_add(1, memory_order_relaxed)),
+      version_(o.version_),
+      transforms_(shareTable(o.transforms_)),
+      materials_(shareTable(o.materials_)),
+      ranges_(shareTable(o.ranges_)),
+      index_map_(shareTable(o.index_map_)),
+      reverse_id_map_(shareTable(o.reverse_id_map_)),
+      free_ids_(o.free_ids_),
+      update_log_(o.update_log_),
+      num_static_instances_(o.num_static_instances_),
+      free_light_ids_(o.free_light_ids_),
+      light_ids_(shareTable(o.light_ids_)),
+      light_reverse_ids_(shareTable(o.light_reverse_ids_))
+{}
+
+Environment Environment::clone() const
+{
+    // The new ID alone makes backends repack the clone in full
+    return Environment(backend_.clone(), *this);
+}
+
 uint32_t Environment::addInstance(uint32_t model_idx,
                                   uint32_t material_idx,
                                   const glm::mat4x3 &model_matrix)
 {
-    transforms_[model_idx].emplace_back(model_matrix);
-    materials_[model_idx].emplace_back(material_idx);
-    uint32_t instance_idx = transforms_[model_idx].size() - 1;
+    // Added instances never go into the default ranges, so those stay
+    // identical to the scene's while they are shared
+    uint32_t range_idx = scene_->envInit.numModels + model_idx;
+    auto &ranges = makeUnique(ranges_);
+    if (ranges[range_idx].count == ranges[range_idx].capacity) {
+        growInstanceRange(range_idx);
+    }
 
+    InstanceRange &range = ranges[range_idx];
+    uint32_t arena_idx = range.offset + range.count++;
+    makeUnique(transforms_)[arena_idx] = model_matrix;
+    makeUnique(materials_)[arena_idx] = material_idx;
+
+    auto &index_map = makeUnique(index_map_);
     uint32_t outer_id;
     if (free_ids_.size() > 0) {
         uint32_t free_id = free_ids_.back();
         free_ids_.pop_back();
-        index_map_[free_id].first = model_idx;
-        index_map_[free_id].second = instance_idx;
+        index_map[free_id].first = range_idx;
+        index_map[free_id].second = arena_idx;
 
         outer_id = free_id;
     } else {
-        index_map_.emplace_back(model_idx, instance_idx);
-        outer_id = index_map_.size() - 1;
+        index_map.emplace_back(range_idx, arena_idx);
+        outer_id = index_map.size() - 1;
     }
 
-    reverse_id_map_[model_idx].emplace_back(outer_id);
+    makeUnique(reverse_id_map_)[arena_idx] = outer_id;
+    version_.topology++;
+    update_log_.clear();
 
     return outer_id;
 }
 
 void Environment::deleteInstance(uint32_t inst_id)
 {
-    auto [model_idx, instance_idx] = index_map_[inst_id];
-    auto &transforms = transforms_[model_idx];
-    auto &materials = materials_[model_idx];
-    auto &reverse_ids = reverse_id_map_[model_idx];
-
-    if (transforms.size() > 1) {
-        // Keep contiguous
-        transforms[instance_idx] = transforms.back();
-        materials[instance_idx] = materials.back();
-        reverse_ids[instance_idx] = reverse_ids.back();
-        index_map_[reverse_ids[instance_idx]] = {model_idx, instance_idx};
+    if (inst_id < num_static_instances_) {
+        detachStaticInstances();
+    }
+
+    auto [range_idx, arena_idx] = (*index_map_)[inst_id];
+    InstanceRange &range = makeUnique(ranges_)[range_idx];
+    uint32_t last_idx = range.offset + --range.count;
+
+    if (arena_idx != last_idx) {
+        // Keep each range contiguous
+        auto &transforms = makeUnique(transforms_);
+        auto &materials = makeUnique(materials_);
+        auto &reverse_id_map = makeUnique(reverse_id_map_);
+        transforms[arena_idx] = transforms[last_idx];
+        materials[arena_idx] = materials[last_idx];
+        reverse_id_map[arena_idx] = reverse_id_map[last_idx];
+        makeUnique(index_map_)[reverse_id_map[arena_idx]].second = arena_idx;
     }
-    transforms.pop_back();
-    materials.pop_back();
-    reverse_ids.pop_back();
 
     free_ids_.push_back(inst_id);
+    version_.topology++;
+    update_log_.clear();
+}
+
+void Environment::updateInstanceTransforms(const uint32_t *inst_ids,
+                                           const glm::mat4x3 *model_matrices,
+                                           uint32_t num_updates)
+{
+    const uint32_t *arena_idxs = logInstanceUpdates(inst_ids, num_updates);
+    auto &transforms = makeUnique(transforms_);
+
+    for (uint32_t i = 0; i < num_updates; i++) {
+        transforms[arena_idxs[i]] = model_matrices[i];
+    }
+}
+
+// Instances are composed in blocks, with the inputs split into one array
+// per component so the arithmetic is vectorized across the block
+static constexpr uint32_t compose_block_size = 8;
+
+void Environment::updateInstanceTransforms(const uint32_t *inst_ids,
+                                           const glm::vec3 *positions,
+                                           const glm::quat *rotations,
+                                           const glm::vec3 *scales,
+                                           uint32_t num_updates)
+{
+    const uint32_t *arena_idxs = logInstanceUpdates(inst_ids, num_updates);
+    auto &transforms = makeUnique(transforms_);
+
+    for (uint32_t block_start = 0; block_start < num_updates;
+         block_start += compose_block_size) {
+        uint32_t block_size =
+            min(compose_block_size, num_updates - block_start);
+
+        float qx[compose_block_size];
+        float qy[compose_block_size];
+        float qz[compose_block_size];
+        float qw[compose_block_size];
+        float sx[compose_block_size];
+        float sy[compose_block_size];
+        float sz[compose_block_size];
+        for (uint32_t i = 0; i < compose_block_size; i++) {
+            // The tail of a partial block repeats its last instance
+            uint32_t idx = block_start + min(i, block_size - 1);
+            const glm::quat &rot = rotations[idx];
+            qx[i] = rot.x;
+            qy[i] = rot.y;
+            qz[i] = rot.z;
+            qw[i] = rot.w;
+
+            glm::vec3 scale = scales ? scales[idx] : glm::vec3(1.f);
+            sx[i] = scale.x;
+            sy[i] = scale.y;
+            sz[i] = scale.z;
+        }
+
+        // Rotation matrix of each quaternion, columns scaled per axis
+        float m[9][compose_block_size];
+        for (uint32_t i = 0; i < compose_block_size; i++) {
+            float xx = qx[i] * qx[i], yy = qy[i] * qy[i], zz = qz[i] * qz[i];
+            float xy = qx[i] * qy[i], xz = qx[i] * qz[i], yz = qy[i] * qz[i];
+            float wx = qw[i] * qx[i], wy = qw[i] * qy[i], wz = qw[i] * qz[i];
+
+            m[0][i] = (1.f - 2.f * (yy + zz)) * sx[i];
+            m[1][i] = 2.f * (xy + wz) * sx[i];
+            m[2][i] = 2.f * (xz - wy) * sx[i];
+            m[3][i] = 2.f * (xy - wz) * sy[i];
+            m[4][i] = (1.f - 2.f * (xx + zz)) * sy[i];
+            m[5][i] = 2.f * (yz + wx) * sy[i];
+            m[6][i] = 2.f * (xz + wy) * sz[i];
+            m[7][i] = 2.f * (yz - wx) * sz[i];
+            m[8][i] = (1.f - 2.f * (xx + yy)) * sz[i];
+        }
+
+        for (uint32_t i = 0; i < block_size; i++) {
+            glm::mat4x3 &txfm = transforms[arena_idxs[block_start + i]];
+            txfm[0] = glm::vec3(m[0][i], m[1][i], m[2][i]);
+            txfm[1] = glm::vec3(m[3][i], m[4][i], m[5][i]);
+            txfm[2] = glm::vec3(m[6][i], m[7][i], m[8][i]);
+            txfm[3] = positions[block_start + i];
+        }
+    }
+}
+
+// Logs a whole batch of transform updates at once, detaching the static
+// instances at most once. Returns the arena index of each instance.
+const uint32_t *Environment::logInstanceUpdates(const uint32_t *inst_ids,
+                                                uint32_t num_updates)
+{
+    for (uint32_t i = 0; i < num_updates; i++) {
+        if (inst_ids[i] < num_static_instances_) {
+            detachStaticInstances();
+            break;
+        }
+    }
+
+    // Same bound as logInstanceUpdate, except that the new entries are
+    // always kept, since they double as the returned arena indices. A
+    // batch larger than the env makes backends upload everything anyway.
+    size_t num_instances = index_map_->size() - free_ids_.size();
+    size_t num_logged = update_log_.size();
+    if (num_logged + num_updates > num_instances) {
+        size_t num_kept = num_updates < num_instances
+            ? min(num_logged / 2, num_instances - num_updates)
+            : 0;
+        update_log_.erase(update_log_.begin(),
+                          update_log_.end() - num_kept);
+        num_logged = num_kept;
+    }
+
+    update_log_.resize(num_logged + num_updates);
+    uint32_t *arena_idxs = update_log_.data() + num_logged;
+    for (uint32_t i = 0; i < num_updates; i++) {
+        arena_idxs[i] = (*index_map_)[inst_ids[i]].second;
+    }
+
+    version_.transforms += num_updates;
+
+    return arena_idxs;
+}
+
+void Environment::growInstanceRange(uint32_t range_idx)
+{
+    auto &ranges = makeUnique(ranges_);
+    auto &transforms = makeUnique(transforms_);
+    auto &materials = makeUnique(materials_);
+    auto &index_map = makeUnique(index_map_);
+    auto &reverse_id_map = makeUnique(reverse_id_map_);
+
+    InstanceRange &range = ranges[range_idx];
+    uint32_t new_capacity = max(4u, range.capacity * 2);
+    uint32_t num_new = new_capacity - range.capacity;
+    uint32_t insert_idx = range.offset + range.capacity;
+
+    transforms.insert(transforms.begin() + insert_idx, num_new,
+                      glm::mat4x3(1.f));
+    materials.insert(materials.begin() + insert_idx, num_new, 0);
+    reverse_id_map.insert(reverse_id_map.begin() + insert_idx, num_new,
+                          ~0u);
+    range.capacity = new_capacity;
+
+    for (uint32_t i = range_idx + 1; i < ranges.size(); i++) {
+        InstanceRange &later = ranges[i];
+        later.offset += num_new;
+
+        for (uint32_t j = 0; j < later.count; j++) {
+            index_map[reverse_id_map[later.offset + j]].second =
+                later.offset + j;
+        }
+    }
+}
+
+void Environment::detachStaticInstances()
+{
+    // The default instances are already stored locally, backends just
+    // need to start treating them as dynamic
+    num_static_instances_ = 0;
+    version_.topology++;
+    update_log_.clear();
 }
 
 uint32_t Environment::addLight(const glm::vec3 &position,
                                const glm::vec3 &color)
 {
     backend_.addLight(position, color);
-    uint32_t light_idx = light_reverse_ids_.size();
+    auto &light_ids = makeUnique(light_ids_);
+    auto &light_reverse_ids = makeUnique(light_reverse_ids_);
+    uint32_t light_idx = light_reverse_ids.size();
 
     uint32_t light_id;
     if (free_light_ids_.size() > 0) {
         uint32_t free_id = free_light_ids_.back();
         free_light_ids_.pop_back();
-        light_ids_[free_id] = light_idx;
+        light_ids[free_id] = light_idx;
 
         light_id = free_id;
     } else {
-        light_ids_.push_back(light_idx);
-        light_id = light_ids_.size() - 1;
+        light_ids.push_back(light_idx);
+        light_id = light_ids.size() - 1;
     }
 
-    light_reverse_ids_.push_back(light_idx);
+    light_reverse_ids.push_back(light_idx);
+    version_.lights++;
+
     return light_id;
 }
 
 void Environment::removeLight(uint32_t light_id)
 {
-    uint32_t light_idx = light_ids_[light_id];
+    uint32_t light_idx = (*light_ids_)[light_id];
     backend_.removeLight(light_idx);
 
-    if (light_reverse_ids_.size() > 1) {
-        light_reverse_ids_[light_idx] = light_reverse_ids_.back();
-        light_ids_[light_reverse_ids_[light_idx]] = light_idx;
+    auto &light_ids = makeUnique(light_ids_);
+    auto &light_reverse_ids = makeUnique(light_reverse_ids_);
+    if (light_reverse_ids.size() > 1) {
+        light_reverse_ids[light_idx] = light_reverse_ids.back();
+        light_ids[light_reverse_ids[light_idx]] = light_idx;
     }
-    light_reverse_ids_.pop_back();
+    light_reverse_ids.pop_back();
 
     free_light_ids_.push_back(light_id);
+    version_.lights++;
 }
 
 EnvironmentImpl::EnvironmentImpl(DestroyType destroy_ptr,
+                                 CloneType clone_ptr,
                                  AddLightType add_light_ptr,
                                  RemoveLightType remove_light_ptr,
                                  EnvironmentBackend *state)
     : destroy_ptr_(destroy_ptr),
+      clone_ptr_(clone_ptr),
       add_light_ptr_(add_light_ptr),
       remove_light_ptr_(remove_light_ptr),
       state_(state)
@@ -226,6 +517,7 @@ EnvironmentImpl::EnvironmentImpl(DestroyType destroy_ptr,
 
 EnvironmentImpl::EnvironmentImpl(EnvironmentImpl &&o)
     : destroy_ptr_(o.destroy_ptr_),
+      clone_ptr_(o.clone_ptr_),
       add_light_ptr_(o.add_light_ptr_),
       remove_light_ptr_(o.remove_light_ptr_),
       state_(o.state_)
@@ -240,6 +532,7 @@ EnvironmentImpl &EnvironmentImpl::operator=(EnvironmentImpl &&o)
     }
 
     destroy_ptr_ = o.destroy_ptr_;
+    clone_ptr_ = o.clone_ptr_;
     add_light_ptr_ = o.add_light_ptr_;
     remove_light_ptr_ = o.remove_light_ptr_;
     state_ = o.state_;
@@ -256,6 +549,12 @@ EnvironmentImpl::~EnvironmentImpl()
     }
 }
 
+EnvironmentImpl EnvironmentImpl::clone() const
+{
+    return EnvironmentImpl(destroy_ptr_, clone_ptr_, add_light_ptr_,
+                           remove_light_ptr_, invoke(clone_ptr_, state_));
+}
+
 uint32_t EnvironmentImpl::addLight(const glm::vec3 &position,
                                    const glm::vec3 &color)
 {
@@ -314,17 +613,41 @@ RendererImpl::RendererImpl(DestroyType destroy_ptr,
                            MakeLoaderType make_loader_ptr,
                            MakeEnvironmentType make_env_ptr,
                            RenderType render_ptr,
+                           RenderRawType render_raw_ptr,
+                           BeginBatchType begin_batch_ptr,
+                           ClaimSlotType claim_slot_ptr,
+                           SetEnvironmentType set_env_ptr,
+                           SubmitBatchType submit_batch_ptr,
                            WaitType wait_ptr,
+                           IsReadyType is_ready_ptr,
+                           GetReadyFDType get_ready_fd_ptr,
+                           SetCallbackType set_callback_ptr,
                            GetColorType get_color_ptr,
                            GetDepthType get_depth_ptr,
+                           GetNumSkippedType get_num_skipped_ptr,
+                           GetDeviceInputsType get_device_inputs_ptr,
+                           GetInputSemaphoreFDType get_input_semaphore_fd_ptr,
+                           ReconfigureType reconfigure_ptr,
                            RenderBackend *state)
     : destroy_ptr_(destroy_ptr),
       make_loader_ptr_(make_loader_ptr),
       make_env_ptr_(make_env_ptr),
       render_ptr_(render_ptr),
+      render_raw_ptr_(render_raw_ptr),
+      begin_batch_ptr_(begin_batch_ptr),
+      claim_slot_ptr_(claim_slot_ptr),
+      set_env_ptr_(set_env_ptr),
+      submit_batch_ptr_(submit_batch_ptr),
       wait_ptr_(wait_ptr),
+      is_ready_ptr_(is_ready_ptr),
+      get_ready_fd_ptr_(get_ready_fd_ptr),
+      set_callback_ptr_(set_callback_ptr),
       get_color_ptr_(get_color_ptr),
       get_depth_ptr_(get_depth_ptr),
+      get_num_skipped_ptr_(get_num_skipped_ptr),
+      get_device_inputs_ptr_(get_device_inputs_ptr),
+      get_input_semaphore_fd_ptr_(get_input_semaphore_fd_ptr),
+      reconfigure_ptr_(reconfigure_ptr),
       state_(state)
 {}
 
@@ -333,9 +656,21 @@ RendererImpl::RendererImpl(RendererImpl &&o)
       make_loader_ptr_(o.make_loader_ptr_),
       make_env_ptr_(o.make_env_ptr_),
       render_ptr_(o.render_ptr_),
+      render_raw_ptr_(o.render_raw_ptr_),
+      begin_batch_ptr_(o.begin_batch_ptr_),
+      claim_slot_ptr_(o.claim_slot_ptr_),
+      set_env_ptr_(o.set_env_ptr_),
+      submit_batch_ptr_(o.submit_batch_ptr_),
       wait_ptr_(o.wait_ptr_),
+      is_ready_ptr_(o.is_ready_ptr_),
+      get_ready_fd_ptr_(o.get_ready_fd_ptr_),
+      set_callback_ptr_(o.set_callback_ptr_),
       get_color_ptr_(o.get_color_ptr_),
       get_depth_ptr_(o.get_depth_ptr_),
+      get_num_skipped_ptr_(o.get_num_skipped_ptr_),
+      get_device_inputs_ptr_(o.get_device_inputs_ptr_),
+      get_input_semaphore_fd_ptr_(o.get_input_semaphore_fd_ptr_),
+      reconfigure_ptr_(o.reconfigure_ptr_),
       state_(o.state_)
 {
     o.state_ = nullptr;
@@ -351,9 +686,21 @@ RendererImpl &RendererImpl::operator=(RendererImpl &&o)
     make_loader_ptr_ = o.make_loader_ptr_;
     make_env_ptr_ = o.make_env_ptr_;
     render_ptr_ = o.render_ptr_;
+    render_raw_ptr_ = o.render_raw_ptr_;
+    begin_batch_ptr_ = o.begin_batch_ptr_;
+    claim_slot_ptr_ = o.claim_slot_ptr_;
+    set_env_ptr_ = o.set_env_ptr_;
+    submit_batch_ptr_ = o.submit_batch_ptr_;
     wait_ptr_ = o.wait_ptr_;
+    is_ready_ptr_ = o.is_ready_ptr_;
+    get_ready_fd_ptr_ = o.get_ready_fd_ptr_;
+    set_callback_ptr_ = o.set_callback_ptr_;
     get_color_ptr_ = o.get_color_ptr_;
     get_depth_ptr_ = o.get_depth_ptr_;
+    get_num_skipped_ptr_ = o.get_num_skipped_ptr_;
+    get_device_inputs_ptr_ = o.get_device_inputs_ptr_;
+    get_input_semaphore_fd_ptr_ = o.get_input_semaphore_fd_ptr_;
+    reconfigure_ptr_ = o.reconfigure_ptr_;
     state_ = o.state_;
 
     o.state_ = nullptr;
@@ -380,9 +727,36 @@ EnvironmentImpl RendererImpl::makeEnvironment(
     return invoke(make_env_ptr_, state_, cam, scene);
 }
 
-uint32_t RendererImpl::render(const Environment *envs)
+uint32_t RendererImpl::render(const Environment *envs,
+                              uint32_t num_envs,
+                              const bool *active)
 {
-    return invoke(render_ptr_, state_, envs);
+    return invoke(render_ptr_, state_, envs, num_envs, active);
+}
+
+uint32_t RendererImpl::renderRaw(const RawBatch &batch)
+{
+    return invoke(render_raw_ptr_, state_, batch);
+}
+
+void RendererImpl::beginBatch()
+{
+    invoke(begin_batch_ptr_, state_);
+}
+
+uint32_t RendererImpl::claimSlot()
+{
+    return invoke(claim_slot_ptr_, state_);
+}
+
+void RendererImpl::setEnvironment(uint32_t slot, const Environment &env)
+{
+    invoke(set_env_ptr_, state_, slot, env);
+}
+
+uint32_t RendererImpl::submitBatch()
+{
+    return invoke(submit_batch_ptr_, state_);
 }
 
 void RendererImpl::waitForFrame(uint32_t frame_idx)
@@ -390,6 +764,21 @@ void RendererImpl::waitForFrame(uint32_t frame_idx)
     invoke(wait_ptr_, state_, frame_idx);
 }
 
+bool RendererImpl::isFrameReady(uint32_t frame_idx)
+{
+    return invoke(is_ready_ptr_, state_, frame_idx);
+}
+
+int RendererImpl::getFrameReadyFD(uint32_t frame_idx)
+{
+    return invoke(get_ready_fd_ptr_, state_, frame_idx);
+}
+
+void RendererImpl::setFrameCallback(function<void(uint32_t)> &&cb)
+{
+    invoke(set_callback_ptr_, state_, move(cb));
+}
+
 uint8_t *RendererImpl::getColorPointer(uint32_t frame_idx)
 {
     return invoke(get_color_ptr_, state_, frame_idx);
@@ -400,4 +789,24 @@ float *RendererImpl::getDepthPointer(uint32_t frame_idx)
     return invoke(get_depth_ptr_, state_, frame_idx);
 }
 
+uint32_t RendererImpl::getNumSkipped(uint32_t frame_idx)
+{
+    return invoke(get_num_skipped_ptr_, state_, frame_idx);
+}
+
+DeviceInputs RendererImpl::getDeviceInputs(uint32_t frame_idx)
+{
+    return invoke(get_device_inputs_ptr_, state_, frame_idx);
+}
+
+int RendererImpl::getInputSemaphoreFD()
+{
+    return invoke(get_input_semaphore_fd_ptr_, state_);
+}
+
+void RendererImpl::reconfigure(const RenderConfig &cfg)
+{
+    invoke(reconfigure_ptr_, state_, cfg);
+}
+
 }
@@ -35,11 +35,19 @@ void destroyEnvironment(EnvironmentBackend *ptr)
     delete backend_ptr;
 }
 
+template <typename EnvType>
+EnvironmentBackend *cloneEnvironment(const EnvironmentBackend *ptr)
+{
+    auto *backend_ptr = static_cast<const EnvType *>(ptr);
+    return new EnvType(*backend_ptr);
+}
+
 template <typename EnvType>
 EnvironmentImpl makeEnvironmentImpl(EnvironmentBackend *ptr)
 {
     return EnvironmentImpl(
         destroyEnvironment<EnvType>,
+        cloneEnvironment<EnvType>,
         static_cast<EnvironmentImpl::AddLightType>(&EnvType::addLight),
         static_cast<EnvironmentImpl::RemoveLightType>(&EnvType::removeLight),
         ptr);
@@ -61,11 +69,31 @@ RendererImpl makeRendererImpl(RenderBackend *ptr)
         static_cast<RendererImpl::MakeEnvironmentType>(
             &RendererType::makeEnvironment),
         static_cast<RendererImpl::RenderType>(&RendererType::render),
+        static_cast<RendererImpl::RenderRawType>(&RendererType::renderRaw),
+        static_cast<RendererImpl::BeginBatchType>(&RendererType::beginBatch),
+        static_cast<RendererImpl::ClaimSlotType>(&RendererType::claimSlot),
+        static_cast<RendererImpl::SetEnvironmentType>(
+            &RendererType::setEnvironment),
+        static_cast<RendererImpl::SubmitBatchType>(
+            &RendererType::submitBatch),
         static_cast<RendererImpl::WaitType>(&RendererType::waitForFrame),
+        static_cast<RendererImpl::IsReadyType>(&RendererType::isFrameReady),
+        static_cast<RendererImpl::GetReadyFDType>(
+            &RendererType::getFrameReadyFD),
+        static_cast<RendererImpl::SetCallbackType>(
+            &RendererType::setFrameCallback),
         static_cast<RendererImpl::GetColorType>(
             &RendererType::getColorPointer),
         static_cast<RendererImpl::GetDepthType>(
             &RendererType::getDepthPointer),
+        static_cast<RendererImpl::GetNumSkippedType>(
+            &RendererType::getNumSkipped),
+        static_cast<RendererImpl::GetDeviceInputsType>(
+            &RendererType::getDeviceInputs),
+        static_cast<RendererImpl::GetInputSemaphoreFDType>(
+            &RendererType::getInputSemaphoreFD),
+        static_cast<RendererImpl::ReconfigureType>(
+            &RendererType::reconfigure),
         ptr);
 }
 
@@ -106,26 +106,37 @@ SceneLoadData SceneLoadData::loadFromDisk(string_view scene_path_name)
 EnvironmentInit::EnvironmentInit(const vector<InstanceProperties> &instances,
                                  const vector<LightProperties> &l,
                                  uint32_t num_meshes)
-    : transforms(num_meshes),
-      materials(num_meshes),
-      indexMap(),
-      reverseIDMap(num_meshes),
+    : numModels(num_meshes),
+      transforms(instances.size()),
+      materials(instances.size()),
+      ranges(num_meshes * 2, InstanceRange {0, 0, 0}),
+      indexMap(instances.size()),
+      reverseIDMap(instances.size()),
       lights(l),
       lightIDs(),
       lightReverseIDs()
 {
-    indexMap.reserve(instances.size());
+    for (const auto &inst : instances) {
+        ranges[inst.meshIndex].capacity++;
+    }
+
+    uint32_t cur_offset = 0;
+    for (InstanceRange &range : ranges) {
+        range.offset = cur_offset;
+        cur_offset += range.capacity;
+    }
 
     for (uint32_t cur_id = 0; cur_id < instances.size(); cur_id++) {
         const auto &inst = instances[cur_id];
         uint32_t mesh_idx = inst.meshIndex;
+        InstanceRange &range = ranges[mesh_idx];
 
-        uint32_t inst_idx = transforms[mesh_idx].size();
+        uint32_t arena_idx = range.offset + range.count++;
 
-        transforms[mesh_idx].push_back(inst.txfm);
-        materials[mesh_idx].push_back(inst.materialIndex);
-        reverseIDMap[mesh_idx].push_back(cur_id);
-        indexMap.emplace_back(mesh_idx, inst_idx);
+        transforms[arena_idx] = inst.txfm;
+        materials[arena_idx] = inst.materialIndex;
+        reverseIDMap[arena_idx] = cur_id;
+        indexMap[cur_id] = {mesh_idx, arena_idx};
     }
 
     lightIDs.reserve(lights.size());
@@ -32,10 +32,15 @@ struct EnvironmentInit {
                     const std::vector<LightProperties> &lights,
                     uint32_t num_meshes);
 
-    std::vector<std::vector<glm::mat4x3>> transforms;
-    std::vector<std::vector<uint32_t>> materials;
+    // Same arena layout as Environment: default instances packed by
+    // model into ranges [0, numModels), followed by numModels empty
+    // ranges for added instances
+    uint32_t numModels;
+    std::vector<glm::mat4x3> transforms;
+    std::vector<uint32_t> materials;
+    std::vector<InstanceRange> ranges;
     std::vector<std::pair<uint32_t, uint32_t>> indexMap;
-    std::vector<std::vector<uint32_t>> reverseIDMap;
+    std::vector<uint32_t> reverseIDMap;
 
     std::vector<LightProperties> lights;
     std::vector<uint32_t> lightIDs;
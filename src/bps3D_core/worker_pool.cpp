@@ -0,0 +1,97 @@
+#include "worker_pool.hpp"
+
+using namespace std;
+
+namespace bps3D {
+
+WorkerPool::WorkerPool(uint32_t num_workers)
+    : workers_(),
+      lock_(),
+      start_cv_(),
+      done_cv_(),
+      generation_(0),
+      num_pending_workers_(0),
+      exit_(false),
+      task_fn_(nullptr),
+      task_data_(nullptr),
+      num_tasks_(0),
+      next_task_(0)
+{
+    workers_.reserve(num_workers);
+    for (uint32_t i = 0; i < num_workers; i++) {
+        workers_.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> guard(lock_);
+        exit_ = true;
+    }
+    start_cv_.notify_all();
+
+    for (thread &worker : workers_) {
+        worker.join();
+    }
+}
+
+void WorkerPool::dispatch(uint32_t num_tasks, TaskFn task_fn, void *task_data)
+{
+    {
+        lock_guard<mutex> guard(lock_);
+        task_fn_ = task_fn;
+        task_data_ = task_data;
+        num_tasks_ = num_tasks;
+        next_task_.store(0, memory_order_relaxed);
+        num_pending_workers_ = workers_.size();
+        generation_++;
+    }
+    start_cv_.notify_all();
+
+    executeTasks();
+
+    unique_lock<mutex> guard(lock_);
+    done_cv_.wait(guard, [this]() { return num_pending_workers_ == 0; });
+}
+
+void WorkerPool::executeTasks()
+{
+    uint32_t task_idx;
+    while ((task_idx = next_task_.fetch_add(1, memory_order_relaxed)) <
+           num_tasks_) {
+        task_fn_(task_data_, task_idx);
+    }
+}
+
+void WorkerPool::workerLoop()
+{
+    uint64_t seen_generation = 0;
+
+    while (true) {
+        {
+            unique_lock<mutex> guard(lock_);
+            start_cv_.wait(guard, [&]() {
+                return exit_ || generation_ != seen_generation;
+            });
+
+            if (exit_) return;
+
+            seen_generation = generation_;
+        }
+
+        executeTasks();
+
+        bool last;
+        {
+            lock_guard<mutex> guard(lock_);
+            last = --num_pending_workers_ == 0;
+        }
+
+        if (last) {
+            done_cv_.notify_one();
+        }
+    }
+}
+
+}
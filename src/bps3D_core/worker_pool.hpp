@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bps3D {
+
+// Fixed set of threads that cooperatively execute a range of tasks.
+// The calling thread participates in run(), so a pool with zero workers
+// simply executes everything inline.
+class WorkerPool {
+public:
+    explicit WorkerPool(uint32_t num_workers);
+    WorkerPool(const WorkerPool &) = delete;
+    ~WorkerPool();
+
+    // Invokes fn(task_idx) for every task_idx in [0, num_tasks) and
+    // returns once all tasks have completed.
+    template <typename Fn>
+    inline void run(uint32_t num_tasks, Fn &&fn);
+
+    uint32_t numThreads() const { return workers_.size() + 1; }
+
+private:
+    using TaskFn = void (*)(void *, uint32_t);
+
+    void dispatch(uint32_t num_tasks, TaskFn task_fn, void *task_data);
+    void executeTasks();
+    void workerLoop();
+
+    std::vector<std::thread> workers_;
+
+    std::mutex lock_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    uint64_t generation_;
+    uint32_t num_pending_workers_;
+    bool exit_;
+
+    TaskFn task_fn_;
+    void *task_data_;
+    uint32_t num_tasks_;
+    std::atomic_uint32_t next_task_;
+};
+
+}
+
+#include "worker_pool.inl"
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <type_traits>
+
+namespace bps3D {
+
+template <typename Fn>
+void WorkerPool::run(uint32_t num_tasks, Fn &&fn)
+{
+    if (num_tasks == 0) return;
+
+    if (workers_.size() == 0 || num_tasks == 1) {
+        for (uint32_t task_idx = 0; task_idx < num_tasks; task_idx++) {
+            fn(task_idx);
+        }
+        return;
+    }
+
+    using FnType = std::remove_reference_t<Fn>;
+
+    dispatch(
+        num_tasks,
+        [](void *data, uint32_t task_idx) {
+            (*static_cast<FnType *>(data))(task_idx);
+        },
+        const_cast<void *>(static_cast<const void *>(std::addressof(fn))));
+}
+
+}
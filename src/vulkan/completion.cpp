@@ -0,0 +1,132 @@
+#include "completion.hpp"
+
+#include "utils.hpp"
+
+#include <iostream>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace bps3D {
+namespace vk {
+
+FrameCompletionNotifier::FrameCompletionNotifier(const DeviceState &d,
+                                                 uint32_t num_batches)
+    : dev(d),
+      ready_fds_(num_batches),
+      lock_(),
+      pending_cv_(),
+      pending_(),
+      callback_(),
+      exit_(false),
+      running_(false),
+      thread_()
+{
+    for (int &fd : ready_fds_) {
+        fd = -1;
+    }
+}
+
+FrameCompletionNotifier::~FrameCompletionNotifier()
+{
+    if (running_.load(memory_order_acquire)) {
+        {
+            lock_guard<mutex> guard(lock_);
+            exit_ = true;
+        }
+        pending_cv_.notify_one();
+        thread_.join();
+    }
+
+    for (int fd : ready_fds_) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+}
+
+void FrameCompletionNotifier::start(const vector<SubmittedFrame> &in_flight)
+{
+    for (int &fd : ready_fds_) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd == -1) {
+            cerr << "Failed to create frame completion eventfd" << endl;
+            fatalExit();
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(lock_);
+        pending_.assign(in_flight.begin(), in_flight.end());
+    }
+
+    // Publishes the eventfds to push and isRunning on other threads
+    running_.store(true, memory_order_release);
+    thread_ = thread([this]() { notifyLoop(); });
+}
+
+int FrameCompletionNotifier::getReadyFD(uint32_t batch_idx) const
+{
+    return ready_fds_[batch_idx];
+}
+
+void FrameCompletionNotifier::setCallback(function<void(uint32_t)> &&cb)
+{
+    lock_guard<mutex> guard(lock_);
+    callback_ = move(cb);
+}
+
+void FrameCompletionNotifier::push(const SubmittedFrame &frame)
+{
+    if (!running_.load(memory_order_acquire)) return;
+
+    {
+        lock_guard<mutex> guard(lock_);
+        pending_.push_back(frame);
+    }
+    pending_cv_.notify_one();
+}
+
+void FrameCompletionNotifier::notifyLoop()
+{
+    while (true) {
+        SubmittedFrame next;
+        {
+            unique_lock<mutex> guard(lock_);
+            pending_cv_.wait(guard,
+                             [this]() { return exit_ || !pending_.empty(); });
+
+            // Everything still pending was submitted, so draining it
+            // can't block forever
+            if (pending_.empty()) return;
+
+            next = pending_.front();
+            pending_.pop_front();
+        }
+
+        // Frames on different queues can complete out of order, but are
+        // still reported in submission order
+        waitForTimelineInfinitely(dev, next.timeline, next.value);
+
+        uint32_t batch_idx = next.batchIdx;
+
+        uint64_t signal = 1;
+        ssize_t num_written =
+            write(ready_fds_[batch_idx], &signal, sizeof(uint64_t));
+        (void)num_written;
+
+        function<void(uint32_t)> cb;
+        {
+            lock_guard<mutex> guard(lock_);
+            cb = callback_;
+        }
+
+        if (cb) {
+            cb(batch_idx);
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <bps3D_core/utils.hpp>
+
+#include "core.hpp"
+
+namespace bps3D {
+namespace vk {
+
+// A submitted batch, complete once the timeline of the queue it was
+// submitted to reaches value
+struct SubmittedFrame {
+    uint32_t batchIdx;
+    VkSemaphore timeline;
+    uint64_t value;
+};
+
+// Follows the renderer's frame timelines on a background thread. As each
+// submitted batch completes, its eventfd is signaled and the completion
+// callback, if any, is invoked. The thread is only started once an
+// eventfd or callback is first requested.
+class FrameCompletionNotifier {
+public:
+    FrameCompletionNotifier(const DeviceState &dev, uint32_t num_batches);
+    FrameCompletionNotifier(const FrameCompletionNotifier &) = delete;
+    ~FrameCompletionNotifier();
+
+    inline bool isRunning() const
+    {
+        return running_.load(std::memory_order_acquire);
+    }
+
+    // Starts the thread, watching the given submissions, in submission
+    // order, that are still in flight
+    void start(const std::vector<SubmittedFrame> &in_flight);
+
+    int getReadyFD(uint32_t batch_idx) const;
+    void setCallback(std::function<void(uint32_t)> &&cb);
+
+    // Records a new submission. Ignored until the thread is running.
+    void push(const SubmittedFrame &frame);
+
+private:
+    void notifyLoop();
+
+    const DeviceState &dev;
+    DynArray<int> ready_fds_;
+
+    std::mutex lock_;
+    std::condition_variable pending_cv_;
+    std::deque<SubmittedFrame> pending_;
+    std::function<void(uint32_t)> callback_;
+    bool exit_;
+
+    std::atomic_bool running_;
+    std::thread thread_;
+};
+
+}
+}
@@ -12,6 +12,14 @@ constexpr float compute_priority = 1.0;
 constexpr float transfer_priority = 1.0;
 constexpr uint32_t descriptor_pool_size = 10;
 constexpr uint32_t minibatch_divisor = 4;
+constexpr uint32_t max_pack_threads = 8;
+constexpr uint32_t pack_envs_per_task = 16;
+constexpr uint32_t record_envs_per_task = 64;
+// Upper limits on attachment layer size and count, further lowered to
+// what the device supports. Batches that don't fit in one layer at this
+// size are split across layers.
+constexpr uint32_t max_fb_dimension = 16384;
+constexpr uint32_t max_fb_layers = 2048;
 
 static constexpr int num_meshlet_vertices = 64;
 static constexpr int num_meshlet_triangles = 126;
@@ -190,6 +190,8 @@ DeviceState InstanceState::makeDevice(
         VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME,
         VK_KHR_SHADER_FLOAT_CONTROLS_EXTENSION_NAME,
         VK_KHR_SPIRV_1_4_EXTENSION_NAME,
+        VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME,
+        VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME,
     };
 
     if (enable_rt) {
@@ -343,14 +345,20 @@ DeviceState InstanceState::makeDevice(
     dev_addr_features.pNext = &eightbit_features;
     dev_addr_features.bufferDeviceAddress = true;
 
-    VkPhysicalDeviceDescriptorIndexingFeatures desc_idx_features {};
-    desc_idx_features.sType =
-        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features {};
+    timeline_features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
     if (enable_rt) {
-        desc_idx_features.pNext = &dev_addr_features;
+        timeline_features.pNext = &dev_addr_features;
     } else {
-        desc_idx_features.pNext = nullptr;
+        timeline_features.pNext = nullptr;
     }
+    timeline_features.timelineSemaphore = true;
+
+    VkPhysicalDeviceDescriptorIndexingFeatures desc_idx_features {};
+    desc_idx_features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+    desc_idx_features.pNext = &timeline_features;
     desc_idx_features.runtimeDescriptorArray = true;
     desc_idx_features.shaderStorageBufferArrayNonUniformIndexing = true;
     desc_idx_features.shaderSampledImageArrayNonUniformIndexing = true;
@@ -365,6 +373,10 @@ DeviceState InstanceState::makeDevice(
     // draw index for retrieving transform, materials etc
     requested_features.features.drawIndirectFirstInstance = true;
 
+    // Each env's image is clipped to with clip distances, since a single
+    // viewport covers a whole framebuffer layer
+    requested_features.features.shaderClipDistance = true;
+
     dev_create_info.pNext = &requested_features;
 
     VkDevice dev;
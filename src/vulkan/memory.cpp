@@ -4,6 +4,8 @@
 #include "utils.hpp"
 #include "config.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <iostream>
 
@@ -247,7 +249,28 @@ static pair<VkBuffer, VkMemoryRequirements> makeUnboundBuffer(
     buffer_info.flags = 0;
     buffer_info.size = num_bytes;
     buffer_info.usage = usage;
-    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    // Buffers are used from the graphics, compute and transfer queues,
+    // so they are shared between families rather than transferred
+    array<uint32_t, 3> queue_families;
+    uint32_t num_queue_families = 0;
+    for (uint32_t qf_idx : {dev.gfxQF, dev.computeQF, dev.transferQF}) {
+        if (find(queue_families.begin(),
+                 queue_families.begin() + num_queue_families,
+                 qf_idx) == queue_families.begin() + num_queue_families) {
+            queue_families[num_queue_families++] = qf_idx;
+        }
+    }
+
+    if (num_queue_families > 1) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = num_queue_families;
+        buffer_info.pQueueFamilyIndices = queue_families.data();
+    } else {
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        buffer_info.queueFamilyIndexCount = 0;
+        buffer_info.pQueueFamilyIndices = nullptr;
+    }
 
     VkBuffer buffer;
     REQ_VK(dev.dt.createBuffer(dev.hdl, &buffer_info, nullptr, &buffer));
@@ -262,6 +285,7 @@ static VkImage makeImage(const DeviceState &dev,
                          uint32_t width,
                          uint32_t height,
                          uint32_t mip_levels,
+                         uint32_t array_layers,
                          VkFormat format,
                          VkImageUsageFlags usage,
                          VkImageCreateFlags img_flags = 0)
@@ -274,7 +298,7 @@ static VkImage makeImage(const DeviceState &dev,
     img_info.format = format;
     img_info.extent = {width, height, 1};
     img_info.mipLevels = mip_levels;
-    img_info.arrayLayers = 1;
+    img_info.arrayLayers = array_layers;
     img_info.samples = VK_SAMPLE_COUNT_1_BIT;
     img_info.tiling = VK_IMAGE_TILING_OPTIMAL;
     img_info.usage = usage;
@@ -336,7 +360,7 @@ static MemoryTypeIndices findTypeIndices(const DeviceState &dev,
                                       VkImageUsageFlags usage_flags,
                                       VkImageCreateFlags img_flags = 0) {
         VkImage test_image =
-            makeImage(dev, 1, 1, 1, format, usage_flags, img_flags);
+            makeImage(dev, 1, 1, 1, 1, format, usage_flags, img_flags);
 
         VkMemoryRequirements reqs = getImageMemReqs(dev, test_image);
 
@@ -472,6 +496,7 @@ HostBuffer MemoryAllocator::makeStagingBuffer(VkDeviceSize num_bytes)
 HostBuffer MemoryAllocator::makeParamBuffer(VkDeviceSize num_bytes)
 {
     return makeHostBuffer(num_bytes, BufferFlags::commonUsage |
+                                         BufferFlags::stageUsage |
                                          BufferFlags::shaderUsage |
                                          BufferFlags::paramUsage);
 }
@@ -533,13 +558,43 @@ pair<LocalBuffer, VkDeviceMemory> MemoryAllocator::makeDedicatedBuffer(
                 memory);
 }
 
+pair<LocalBuffer, VkDeviceMemory> MemoryAllocator::makeExportableBuffer(
+    VkDeviceSize num_bytes)
+{
+    auto [buffer, reqs] =
+        makeUnboundBuffer(dev, num_bytes, local_buffer_usage_flags_);
+
+    VkExportMemoryAllocateInfo export_info;
+    export_info.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
+    export_info.pNext = nullptr;
+    export_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+
+    VkMemoryDedicatedAllocateInfo dedicated;
+    dedicated.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    dedicated.pNext = &export_info;
+    dedicated.image = VK_NULL_HANDLE;
+    dedicated.buffer = buffer;
+    VkMemoryAllocateInfo alloc;
+    alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc.pNext = &dedicated;
+    alloc.allocationSize = reqs.size;
+    alloc.memoryTypeIndex = type_indices_.local;
+
+    VkDeviceMemory memory;
+    REQ_VK(dev.dt.allocateMemory(dev.hdl, &alloc, nullptr, &memory));
+    REQ_VK(dev.dt.bindBufferMemory(dev.hdl, buffer, memory, 0));
+
+    return pair(LocalBuffer(buffer, AllocDeleter<false>(memory, *this)),
+                memory);
+}
+
 pair<LocalTexture, TextureRequirements> MemoryAllocator::makeTexture(
     uint32_t width,
     uint32_t height,
     uint32_t mip_levels)
 {
     VkImage texture_img =
-        makeImage(dev, width, height, mip_levels, formats_.texture,
+        makeImage(dev, width, height, mip_levels, 1, formats_.texture,
                   ImageFlags::textureUsage);
 
     auto reqs = getImageMemReqs(dev, texture_img);
@@ -584,11 +639,13 @@ optional<VkDeviceMemory> MemoryAllocator::alloc(VkDeviceSize num_bytes)
 LocalImage MemoryAllocator::makeDedicatedImage(uint32_t width,
                                                uint32_t height,
                                                uint32_t mip_levels,
+                                               uint32_t array_layers,
                                                VkFormat format,
                                                VkImageUsageFlags usage,
                                                uint32_t type_idx)
 {
-    auto img = makeImage(dev, width, height, mip_levels, format, usage);
+    auto img = makeImage(dev, width, height, mip_levels, array_layers, format,
+                         usage);
     auto reqs = getImageMemReqs(dev, img);
 
     VkMemoryDedicatedAllocateInfo dedicated;
@@ -611,25 +668,31 @@ LocalImage MemoryAllocator::makeDedicatedImage(uint32_t width,
 }
 
 LocalImage MemoryAllocator::makeColorAttachment(uint32_t width,
-                                                uint32_t height)
+                                                uint32_t height,
+                                                uint32_t layers)
 {
-    return makeDedicatedImage(width, height, 1, formats_.colorAttachment,
+    return makeDedicatedImage(width, height, 1, layers,
+                              formats_.colorAttachment,
                               ImageFlags::colorAttachmentUsage,
                               type_indices_.colorAttachment);
 }
 
 LocalImage MemoryAllocator::makeDepthAttachment(uint32_t width,
-                                                uint32_t height)
+                                                uint32_t height,
+                                                uint32_t layers)
 {
-    return makeDedicatedImage(width, height, 1, formats_.depthAttachment,
+    return makeDedicatedImage(width, height, 1, layers,
+                              formats_.depthAttachment,
                               ImageFlags::depthAttachmentUsage,
                               type_indices_.depthAttachment);
 }
 
 LocalImage MemoryAllocator::makeLinearDepthAttachment(uint32_t width,
-                                                      uint32_t height)
+                                                      uint32_t height,
+                                                      uint32_t layers)
 {
-    return makeDedicatedImage(width, height, 1, formats_.linearDepthAttachment,
+    return makeDedicatedImage(width, height, 1, layers,
+                              formats_.linearDepthAttachment,
                               ImageFlags::colorAttachmentUsage,
                               type_indices_.colorAttachment);
 }
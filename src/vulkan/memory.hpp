@@ -148,6 +148,10 @@ public:
     std::pair<LocalBuffer, VkDeviceMemory> makeDedicatedBuffer(
         VkDeviceSize num_bytes);
 
+    // Dedicated local buffer with memory that can be imported into CUDA
+    std::pair<LocalBuffer, VkDeviceMemory> makeExportableBuffer(
+        VkDeviceSize num_bytes);
+
     std::pair<LocalTexture, TextureRequirements>
     makeTexture(uint32_t width, uint32_t height, uint32_t mip_levels);
 
@@ -155,9 +159,15 @@ public:
 
     std::optional<VkDeviceMemory> alloc(VkDeviceSize num_bytes);
 
-    LocalImage makeColorAttachment(uint32_t width, uint32_t height);
-    LocalImage makeDepthAttachment(uint32_t width, uint32_t height);
-    LocalImage makeLinearDepthAttachment(uint32_t width, uint32_t height);
+    LocalImage makeColorAttachment(uint32_t width,
+                                   uint32_t height,
+                                   uint32_t layers);
+    LocalImage makeDepthAttachment(uint32_t width,
+                                   uint32_t height,
+                                   uint32_t layers);
+    LocalImage makeLinearDepthAttachment(uint32_t width,
+                                         uint32_t height,
+                                         uint32_t layers);
 
     const ResourceFormats &getFormats() const { return formats_; }
 
@@ -174,6 +184,7 @@ private:
     LocalImage makeDedicatedImage(uint32_t width,
                                   uint32_t height,
                                   uint32_t mip_levels,
+                                  uint32_t array_layers,
                                   VkFormat format,
                                   VkImageUsageFlags usage,
                                   uint32_t type_idx);
@@ -2,7 +2,16 @@
 
 #include "scene.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <tuple>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -23,7 +32,13 @@ static BackendConfig getBackendConfig(const RenderConfig &cfg)
         depth_output,
         need_materials,
         need_lighting,
-        cfg.doubleBuffered ? 2u : 1u,
+        cfg.numInFlightBatches > 0 ? cfg.numInFlightBatches
+                                   : (cfg.doubleBuffered ? 2u : 1u),
+        !cfg.hostVisibleInstances || cfg.deviceInputs,
+        cfg.zeroInactiveOutputs,
+        cfg.asyncCompute,
+        cfg.multiQueue,
+        cfg.deviceInputs,
     };
 }
 
@@ -47,11 +62,22 @@ static ParamBufferConfig getParamBufferConfig(const BackendConfig &backend_cfg,
         cur_offset = cfg.materialIndicesOffset + cfg.totalMaterialIndexBytes;
     }
 
+    VkDeviceSize instance_end = cur_offset;
+
     cfg.viewOffset = alloc.alignUniformBufferOffset(cur_offset);
     cfg.totalViewBytes = sizeof(ViewInfo) * batch_size;
 
     cur_offset = cfg.viewOffset + cfg.totalViewBytes;
 
+    if (backend_cfg.deviceInputs) {
+        instance_end = cur_offset;
+    }
+
+    if (backend_cfg.deviceLocalInstances) {
+        cfg.totalInstanceBytes = alloc.alignStorageBufferOffset(
+            alloc.alignUniformBufferOffset(instance_end));
+    }
+
     if (backend_cfg.needLighting) {
         cfg.lightsOffset = alloc.alignUniformBufferOffset(cur_offset);
         cfg.totalLightParamBytes =
@@ -60,9 +86,25 @@ static ParamBufferConfig getParamBufferConfig(const BackendConfig &backend_cfg,
         cur_offset = cfg.lightsOffset + cfg.totalLightParamBytes;
     }
 
-    cfg.cullInputOffset = alloc.alignStorageBufferOffset(cur_offset);
-    cfg.totalCullInputBytes = sizeof(DrawInput) * VulkanConfig::max_instances;
-    cur_offset = cfg.cullInputOffset + cfg.totalCullInputBytes;
+    cfg.drawRangeOffset = alloc.alignStorageBufferOffset(cur_offset);
+    cfg.totalDrawRangeBytes =
+        sizeof(DrawRange) * VulkanConfig::max_draw_ranges;
+    cur_offset = cfg.drawRangeOffset + cfg.totalDrawRangeBytes;
+
+    cfg.cullParamsOffset = alloc.alignStorageBufferOffset(cur_offset);
+    cfg.totalCullParamBytes = sizeof(CullEnvParams) * batch_size;
+    cur_offset = cfg.cullParamsOffset + cfg.totalCullParamBytes;
+
+    cfg.cullDispatchOffset = alloc.alignStorageBufferOffset(cur_offset);
+    cfg.totalCullDispatchBytes = sizeof(CullDispatchEnv) * batch_size;
+    cur_offset = cfg.cullDispatchOffset + cfg.totalCullDispatchBytes;
+
+    if (backend_cfg.deviceLocalInstances) {
+        cfg.scatterInputOffset = alloc.alignStorageBufferOffset(cur_offset);
+        cfg.totalScatterInputBytes =
+            sizeof(InstanceScatter) * VulkanConfig::max_instance_scatters;
+        cur_offset = cfg.scatterInputOffset + cfg.totalScatterInputBytes;
+    }
 
     // Ensure that full block is aligned to maximum requirement
     cfg.totalParamBytes = alloc.alignStorageBufferOffset(
@@ -74,59 +116,106 @@ static ParamBufferConfig getParamBufferConfig(const BackendConfig &backend_cfg,
     cfg.drawIndirectOffset = alloc.alignStorageBufferOffset(
         alloc.alignUniformBufferOffset(cfg.totalCountIndirectBytes));
     cfg.totalDrawIndirectBytes =
-        sizeof(VkDrawIndexedIndirectCommand) * VulkanConfig::max_instances;
+        sizeof(DrawCommand) * VulkanConfig::max_instances;
+
+    cfg.drawInputOffset = alloc.alignStorageBufferOffset(
+        cfg.drawIndirectOffset + cfg.totalDrawIndirectBytes);
+    cfg.totalDrawInputBytes = sizeof(DrawInput) * VulkanConfig::max_instances;
 
     cfg.totalIndirectBytes =
         alloc.alignStorageBufferOffset(alloc.alignUniformBufferOffset(
-            cfg.drawIndirectOffset + cfg.totalDrawIndirectBytes));
+            cfg.drawInputOffset + cfg.totalDrawInputBytes));
 
     return cfg;
 }
 
+static FramebufferLimits getFramebufferLimits(const InstanceState &inst,
+                                              VkPhysicalDevice phy)
+{
+    VkPhysicalDeviceProperties2 props {};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    inst.dt.getPhysicalDeviceProperties2(phy, &props);
+
+    const VkPhysicalDeviceLimits &limits = props.properties.limits;
+
+    return FramebufferLimits {
+        min({VulkanConfig::max_fb_dimension, limits.maxImageDimension2D,
+             limits.maxFramebufferWidth, limits.maxFramebufferHeight}),
+        min({VulkanConfig::max_fb_layers, limits.maxFramebufferLayers,
+             limits.maxImageArrayLayers}),
+    };
+}
+
 static FramebufferConfig getFramebufferConfig(const RenderConfig &cfg,
-                                              const BackendConfig &backend_cfg)
+                                              const BackendConfig &backend_cfg,
+                                              const FramebufferLimits &limits)
 {
     uint32_t batch_size = cfg.batchSize;
     uint32_t num_batches = backend_cfg.numBatches;
 
-    uint32_t minibatch_size =
-        max(batch_size / VulkanConfig::minibatch_divisor, batch_size);
-    assert(batch_size % minibatch_size == 0);
-
-    uint32_t batch_fb_images_wide = ceil(sqrt(batch_size));
-    while (batch_size % batch_fb_images_wide != 0) {
-        batch_fb_images_wide++;
+    // Up to minibatch_divisor equal mini batches, fewer when the batch
+    // size isn't a multiple of it
+    uint32_t num_minibatches =
+        min(VulkanConfig::minibatch_divisor, batch_size);
+    while (batch_size % num_minibatches != 0) {
+        num_minibatches--;
     }
+    uint32_t minibatch_size = batch_size / num_minibatches;
+
+    // Split each mini batch across as few layers as possible, where each
+    // layer is a roughly square grid of images
+    uint32_t layer_images_wide = 0;
+    uint32_t layer_images_tall = 0;
+    uint32_t layers_per_minibatch = 0;
+    for (uint32_t num_layers = 1; num_layers <= minibatch_size;
+         num_layers++) {
+        if (minibatch_size % num_layers != 0) {
+            continue;
+        }
 
-    uint32_t minibatch_fb_images_wide;
-    uint32_t minibatch_fb_images_tall;
-    if (batch_fb_images_wide >= minibatch_size) {
-        assert(batch_fb_images_wide % minibatch_size == 0);
-        minibatch_fb_images_wide = minibatch_size;
-        minibatch_fb_images_tall = 1;
-    } else {
-        minibatch_fb_images_wide = batch_fb_images_wide;
-        minibatch_fb_images_tall = minibatch_size / batch_fb_images_wide;
+        uint32_t images_per_layer = minibatch_size / num_layers;
+
+        uint32_t images_wide = ceil(sqrt(images_per_layer));
+        while (images_per_layer % images_wide != 0) {
+            images_wide++;
+        }
+        uint32_t images_tall = images_per_layer / images_wide;
+
+        if (images_wide * cfg.imgWidth <= limits.maxDimension &&
+            images_tall * cfg.imgHeight <= limits.maxDimension) {
+            layer_images_wide = images_wide;
+            layer_images_tall = images_tall;
+            layers_per_minibatch = num_layers;
+            break;
+        }
     }
 
-    assert(minibatch_fb_images_wide * minibatch_fb_images_tall ==
-           minibatch_size);
+    if (layers_per_minibatch == 0) {
+        cerr << "Image resolution " << cfg.imgWidth << "x" << cfg.imgHeight
+             << " exceeds the maximum framebuffer size" << endl;
+        fatalExit();
+    }
 
-    uint32_t batch_fb_images_tall = (batch_size / batch_fb_images_wide);
-    assert(batch_fb_images_wide * batch_fb_images_tall == batch_size);
+    uint32_t layers_per_batch =
+        layers_per_minibatch * (batch_size / minibatch_size);
+    uint32_t total_layers = layers_per_batch * num_batches;
 
-    uint32_t batch_fb_width = cfg.imgWidth * batch_fb_images_wide;
-    uint32_t batch_fb_height = cfg.imgHeight * batch_fb_images_tall;
+    if (total_layers > limits.maxLayers) {
+        cerr << "Batch size " << batch_size << " at " << cfg.imgWidth << "x"
+             << cfg.imgHeight << " needs " << total_layers
+             << " framebuffer layers, more than the maximum of "
+             << limits.maxLayers << endl;
+        fatalExit();
+    }
 
-    uint32_t total_fb_width = batch_fb_width * num_batches;
-    uint32_t total_fb_height = batch_fb_height;
+    uint64_t batch_pixels =
+        uint64_t(cfg.imgWidth) * uint64_t(cfg.imgHeight) * batch_size;
 
     vector<VkClearValue> clear_vals;
 
     uint64_t frame_color_bytes = 0;
     if (backend_cfg.colorOutput) {
-        frame_color_bytes =
-            4 * sizeof(uint8_t) * batch_fb_width * batch_fb_height;
+        frame_color_bytes = 4 * sizeof(uint8_t) * batch_pixels;
 
         VkClearValue clear_val;
         clear_val.color = {{0.f, 0.f, 0.f, 1.f}};
@@ -136,7 +225,7 @@ static FramebufferConfig getFramebufferConfig(const RenderConfig &cfg,
 
     uint64_t frame_depth_bytes = 0;
     if (backend_cfg.depthOutput) {
-        frame_depth_bytes = sizeof(float) * batch_fb_width * batch_fb_height;
+        frame_depth_bytes = sizeof(float) * batch_pixels;
 
         VkClearValue clear_val;
         clear_val.color = {{0.f, 0.f, 0.f, 0.f}};
@@ -149,21 +238,20 @@ static FramebufferConfig getFramebufferConfig(const RenderConfig &cfg,
 
     clear_vals.push_back(depth_clear_value);
 
-    uint32_t frame_linear_bytes = frame_color_bytes + frame_depth_bytes;
+    uint64_t frame_linear_bytes = frame_color_bytes + frame_depth_bytes;
 
     assert(frame_linear_bytes > 0);
 
     return FramebufferConfig {cfg.imgWidth,
                               cfg.imgHeight,
                               minibatch_size,
-                              minibatch_fb_images_wide,
-                              minibatch_fb_images_tall,
-                              batch_fb_images_wide,
-                              batch_fb_images_tall,
-                              batch_fb_width,
-                              batch_fb_height,
-                              total_fb_width,
-                              total_fb_height,
+                              layer_images_wide,
+                              layer_images_tall,
+                              layers_per_minibatch,
+                              layers_per_batch,
+                              cfg.imgWidth * layer_images_wide,
+                              cfg.imgHeight * layer_images_tall,
+                              total_layers,
                               frame_color_bytes,
                               frame_depth_bytes,
                               frame_linear_bytes,
@@ -220,6 +308,27 @@ static VkRenderPass makeRenderPass(const DeviceState &dev,
     subpass_desc.pColorAttachments = &attachment_refs[0];
     subpass_desc.pDepthStencilAttachment = &attachment_refs.back();
 
+    // Each mini batch's outputs are copied out right after its render
+    // pass, and copies wait for the attachment writes. Mini batches draw
+    // to disjoint layers, so later render passes don't wait for earlier
+    // copies, letting them overlap. Copies from the batch's previous
+    // submission are waited for once, before its first render pass.
+    constexpr VkPipelineStageFlags attachment_stages =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    constexpr VkAccessFlags attachment_writes =
+        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    array<VkSubpassDependency, 2> dependencies {{
+        {VK_SUBPASS_EXTERNAL, 0, attachment_stages, attachment_stages,
+         attachment_writes, attachment_writes, 0},
+        {0, VK_SUBPASS_EXTERNAL, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+         VK_ACCESS_TRANSFER_READ_BIT, 0},
+    }};
+
     VkRenderPassCreateInfo render_pass_info;
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     render_pass_info.pNext = nullptr;
@@ -229,8 +338,9 @@ static VkRenderPass makeRenderPass(const DeviceState &dev,
     render_pass_info.pAttachments = attachment_descs.data();
     render_pass_info.subpassCount = 1;
     render_pass_info.pSubpasses = &subpass_desc;
-    render_pass_info.dependencyCount = 0;
-    render_pass_info.pDependencies = nullptr;
+    render_pass_info.dependencyCount =
+        static_cast<uint32_t>(dependencies.size());
+    render_pass_info.pDependencies = dependencies.data();
 
     VkRenderPass render_pass;
     REQ_VK(dev.dt.createRenderPass(dev.hdl, &render_pass_info, nullptr,
@@ -305,8 +415,6 @@ static RenderState makeRenderState(const DeviceState &dev,
 
     ShaderPipeline cull_shader(dev, {"meshcull.comp"}, {}, shader_defines);
 
-    FixedDescriptorPool cull_pool(dev, cull_shader, 0, backend_cfg.numBatches);
-
     ShaderPipeline draw_shader(
         dev, {"uber.vert", "uber.frag"},
         {
@@ -316,16 +424,20 @@ static RenderState makeRenderState(const DeviceState &dev,
         },
         shader_defines);
 
-    FixedDescriptorPool draw_pool(dev, draw_shader, 0, backend_cfg.numBatches);
+    ShaderPipeline scatter_shader(dev, {"instancescatter.comp"}, {},
+                                  shader_defines);
+
+    ShaderPipeline expand_shader(dev, {"drawexpand.comp"}, {},
+                                 shader_defines);
 
     return RenderState {
         texture_sampler,
         makeRenderPass(dev, alloc.getFormats(), backend_cfg.colorOutput,
                        backend_cfg.depthOutput),
         move(cull_shader),
-        move(cull_pool),
         move(draw_shader),
-        move(draw_pool),
+        move(scatter_shader),
+        move(expand_shader),
     };
 }
 
@@ -359,7 +471,7 @@ static PipelineState makePipeline(const DeviceState &dev,
     input_assembly_info.primitiveRestartEnable = VK_FALSE;
 
     // Viewport
-    VkRect2D scissors {{0, 0}, {fb_cfg.totalWidth, fb_cfg.totalHeight}};
+    VkRect2D scissors {{0, 0}, {fb_cfg.layerWidth, fb_cfg.layerHeight}};
 
     VkPipelineViewportStateCreateInfo viewport_info {};
     viewport_info.sType =
@@ -435,7 +547,7 @@ static PipelineState makePipeline(const DeviceState &dev,
 
     // Push constant
     VkPushConstantRange push_const {
-        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+        VK_SHADER_STAGE_VERTEX_BIT,
         0,
         sizeof(DrawPushConstant),
     };
@@ -554,6 +666,70 @@ static PipelineState makePipeline(const DeviceState &dev,
                                          &cull_compute_info, nullptr,
                                          &cull_pipeline));
 
+    // Compute shader for partial instance updates
+    VkDescriptorSetLayout scatter_desc_layout =
+        render_state.scatter.getLayout(0);
+
+    VkPushConstantRange scatter_const {
+        VK_SHADER_STAGE_COMPUTE_BIT,
+        0,
+        sizeof(ScatterPushConstant),
+    };
+
+    VkPipelineLayoutCreateInfo scatter_layout_info;
+    scatter_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    scatter_layout_info.pNext = nullptr;
+    scatter_layout_info.flags = 0;
+    scatter_layout_info.setLayoutCount = 1;
+    scatter_layout_info.pSetLayouts = &scatter_desc_layout;
+    scatter_layout_info.pushConstantRangeCount = 1;
+    scatter_layout_info.pPushConstantRanges = &scatter_const;
+
+    VkPipelineLayout scatter_layout;
+    REQ_VK(dev.dt.createPipelineLayout(dev.hdl, &scatter_layout_info, nullptr,
+                                       &scatter_layout));
+
+    VkComputePipelineCreateInfo scatter_compute_info = cull_compute_info;
+    scatter_compute_info.stage.module = render_state.scatter.getShader(0);
+    scatter_compute_info.layout = scatter_layout;
+
+    VkPipeline scatter_pipeline;
+    REQ_VK(dev.dt.createComputePipelines(dev.hdl, pipeline_cache, 1,
+                                         &scatter_compute_info, nullptr,
+                                         &scatter_pipeline));
+
+    // Compute shader expanding draw ranges into cull inputs
+    VkDescriptorSetLayout expand_desc_layout =
+        render_state.expand.getLayout(0);
+
+    VkPushConstantRange expand_const {
+        VK_SHADER_STAGE_COMPUTE_BIT,
+        0,
+        sizeof(ExpandPushConstant),
+    };
+
+    VkPipelineLayoutCreateInfo expand_layout_info;
+    expand_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    expand_layout_info.pNext = nullptr;
+    expand_layout_info.flags = 0;
+    expand_layout_info.setLayoutCount = 1;
+    expand_layout_info.pSetLayouts = &expand_desc_layout;
+    expand_layout_info.pushConstantRangeCount = 1;
+    expand_layout_info.pPushConstantRanges = &expand_const;
+
+    VkPipelineLayout expand_layout;
+    REQ_VK(dev.dt.createPipelineLayout(dev.hdl, &expand_layout_info, nullptr,
+                                       &expand_layout));
+
+    VkComputePipelineCreateInfo expand_compute_info = cull_compute_info;
+    expand_compute_info.stage.module = render_state.expand.getShader(0);
+    expand_compute_info.layout = expand_layout;
+
+    VkPipeline expand_pipeline;
+    REQ_VK(dev.dt.createComputePipelines(dev.hdl, pipeline_cache, 1,
+                                         &expand_compute_info, nullptr,
+                                         &expand_pipeline));
+
     return PipelineState {
         pipeline_cache,
         RasterPipelineState {
@@ -561,6 +737,10 @@ static PipelineState makePipeline(const DeviceState &dev,
             cull_pipeline,
             draw_layout,
             draw_pipeline,
+            scatter_layout,
+            scatter_pipeline,
+            expand_layout,
+            expand_pipeline,
         },
     };
 }
@@ -573,78 +753,86 @@ static FramebufferState makeFramebuffer(const DeviceState &dev,
                                         VkRenderPass render_pass)
 {
     vector<LocalImage> attachments;
-    vector<VkImageView> attachment_views;
-
-    VkImageViewCreateInfo view_info {};
-    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    VkImageSubresourceRange &view_info_sr = view_info.subresourceRange;
-    view_info_sr.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    view_info_sr.baseMipLevel = 0;
-    view_info_sr.levelCount = 1;
-    view_info_sr.baseArrayLayer = 0;
-    view_info_sr.layerCount = 1;
+    vector<VkFormat> attachment_formats;
 
     if (backend_cfg.colorOutput) {
-        attachments.emplace_back(
-            alloc.makeColorAttachment(fb_cfg.totalWidth, fb_cfg.totalHeight));
-
-        VkImageView color_view;
-        view_info.image = attachments.back().image;
-        view_info.format = alloc.getFormats().colorAttachment;
-
-        REQ_VK(
-            dev.dt.createImageView(dev.hdl, &view_info, nullptr, &color_view));
-
-        attachment_views.push_back(color_view);
+        attachments.emplace_back(alloc.makeColorAttachment(
+            fb_cfg.layerWidth, fb_cfg.layerHeight, fb_cfg.totalLayers));
+        attachment_formats.push_back(alloc.getFormats().colorAttachment);
     }
 
     if (backend_cfg.depthOutput) {
         attachments.emplace_back(alloc.makeLinearDepthAttachment(
-            fb_cfg.totalWidth, fb_cfg.totalHeight));
-
-        VkImageView linear_depth_view;
-        view_info.image = attachments.back().image;
-        view_info.format = alloc.getFormats().linearDepthAttachment;
-
-        REQ_VK(dev.dt.createImageView(dev.hdl, &view_info, nullptr,
-                                      &linear_depth_view));
-
-        attachment_views.push_back(linear_depth_view);
+            fb_cfg.layerWidth, fb_cfg.layerHeight, fb_cfg.totalLayers));
+        attachment_formats.push_back(alloc.getFormats().linearDepthAttachment);
     }
 
-    VkFramebuffer fb_handle = VK_NULL_HANDLE;
-    attachments.emplace_back(
-        alloc.makeDepthAttachment(fb_cfg.totalWidth, fb_cfg.totalHeight));
-
-    view_info.image = attachments.back().image;
-    view_info.format = alloc.getFormats().depthAttachment;
-    view_info_sr.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    attachments.emplace_back(alloc.makeDepthAttachment(
+        fb_cfg.layerWidth, fb_cfg.layerHeight, fb_cfg.totalLayers));
+    attachment_formats.push_back(alloc.getFormats().depthAttachment);
 
-    VkImageView depth_view;
-    REQ_VK(dev.dt.createImageView(dev.hdl, &view_info, nullptr, &depth_view));
-    attachment_views.push_back(depth_view);
+    VkImageViewCreateInfo view_info {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    VkImageSubresourceRange &view_info_sr = view_info.subresourceRange;
+    view_info_sr.baseMipLevel = 0;
+    view_info_sr.levelCount = 1;
+    view_info_sr.layerCount = fb_cfg.numLayersPerMiniBatch;
 
     VkFramebufferCreateInfo fb_info;
     fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     fb_info.pNext = nullptr;
     fb_info.flags = 0;
     fb_info.renderPass = render_pass;
-    fb_info.attachmentCount = static_cast<uint32_t>(attachment_views.size());
-    fb_info.pAttachments = attachment_views.data();
-    fb_info.width = fb_cfg.totalWidth;
-    fb_info.height = fb_cfg.totalHeight;
-    fb_info.layers = 1;
+    fb_info.attachmentCount = static_cast<uint32_t>(attachments.size());
+    fb_info.width = fb_cfg.layerWidth;
+    fb_info.height = fb_cfg.layerHeight;
+    fb_info.layers = fb_cfg.numLayersPerMiniBatch;
+
+    // Each mini batch gets a framebuffer over just its own layers, so its
+    // render pass doesn't clear anything else
+    uint32_t num_framebuffers =
+        fb_cfg.totalLayers / fb_cfg.numLayersPerMiniBatch;
+
+    vector<VkImageView> attachment_views;
+    vector<VkFramebuffer> fb_handles;
+    attachment_views.reserve(num_framebuffers * attachments.size());
+    fb_handles.reserve(num_framebuffers);
+
+    for (uint32_t fb_idx = 0; fb_idx < num_framebuffers; fb_idx++) {
+        view_info_sr.baseArrayLayer = fb_idx * fb_cfg.numLayersPerMiniBatch;
+        uint32_t first_view = attachment_views.size();
+
+        for (uint32_t attachment_idx = 0; attachment_idx < attachments.size();
+             attachment_idx++) {
+            view_info.image = attachments[attachment_idx].image;
+            view_info.format = attachment_formats[attachment_idx];
+            // The depth attachment is always last
+            view_info_sr.aspectMask = attachment_idx + 1 == attachments.size()
+                                          ? VK_IMAGE_ASPECT_DEPTH_BIT
+                                          : VK_IMAGE_ASPECT_COLOR_BIT;
+
+            VkImageView view;
+            REQ_VK(
+                dev.dt.createImageView(dev.hdl, &view_info, nullptr, &view));
+            attachment_views.push_back(view);
+        }
+
+        fb_info.pAttachments = attachment_views.data() + first_view;
 
-    REQ_VK(dev.dt.createFramebuffer(dev.hdl, &fb_info, nullptr, &fb_handle));
+        VkFramebuffer fb_handle;
+        REQ_VK(
+            dev.dt.createFramebuffer(dev.hdl, &fb_info, nullptr, &fb_handle));
+        fb_handles.push_back(fb_handle);
+    }
 
     auto [result_buffer, result_mem] =
         alloc.makeDedicatedBuffer(fb_cfg.totalLinearBytes);
 
     return FramebufferState {
         move(attachments),
-        attachment_views,
-        fb_handle,
+        move(attachment_views),
+        move(fb_handles),
         move(result_buffer),
         result_mem,
         CudaImportedBuffer(dev, cfg.gpuID, result_mem,
@@ -652,132 +840,186 @@ static FramebufferState makeFramebuffer(const DeviceState &dev,
     };
 }
 
+// Output copies are recorded per mini batch, into secondaries that the
+// render commands execute right after each mini batch's render pass. The
+// render pass's external dependency orders them after the draws.
 static void recordFBToLinearCopy(const DeviceState &dev,
                                  const BackendConfig &backend_cfg,
                                  const PerBatchState &state,
                                  const FramebufferConfig &fb_cfg,
                                  const FramebufferState &fb)
 {
-    vector<VkImageMemoryBarrier> fb_barriers;
-
-    uint32_t view_offset = 0;
-    if (backend_cfg.colorOutput) {
-        fb_barriers.emplace_back(
-            VkImageMemoryBarrier {VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-                                  nullptr,
-                                  VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-                                  VK_ACCESS_TRANSFER_READ_BIT,
-                                  VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                  VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                  VK_QUEUE_FAMILY_IGNORED,
-                                  VK_QUEUE_FAMILY_IGNORED,
-                                  fb.attachments[view_offset].image,
-                                  {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}});
-
-        view_offset++;
-    }
+    DynArray<VkBufferImageCopy> copy_regions(fb_cfg.miniBatchSize);
 
-    if (backend_cfg.depthOutput) {
-        fb_barriers.emplace_back(
-            VkImageMemoryBarrier {VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-                                  nullptr,
-                                  VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-                                  VK_ACCESS_TRANSFER_READ_BIT,
-                                  VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                  VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                  VK_QUEUE_FAMILY_IGNORED,
-                                  VK_QUEUE_FAMILY_IGNORED,
-                                  fb.attachments[view_offset].image,
-                                  {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}});
-
-        view_offset++;
-    }
-
-    VkCommandBuffer copy_cmd = state.commands[1];
-
-    VkCommandBufferBeginInfo begin_info {};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    REQ_VK(dev.dt.beginCommandBuffer(copy_cmd, &begin_info));
-    dev.dt.cmdPipelineBarrier(
-        copy_cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_DEPENDENCY_BY_REGION_BIT, 0,
-        nullptr, 0, nullptr, static_cast<uint32_t>(fb_barriers.size()),
-        fb_barriers.data());
-
-    uint32_t batch_size = state.batchFBOffsets.size();
-
-    DynArray<VkBufferImageCopy> copy_regions(batch_size);
-
-    auto make_copy_cmd = [&](VkDeviceSize base_offset, uint32_t texel_bytes,
+    // Inactive slots get no copy region, their output is either left as
+    // is or cleared. Skipped slots keep their previous output.
+    auto make_copy_cmd = [&](VkCommandBuffer copy_cmd,
+                             uint32_t mini_batch_offset,
+                             VkDeviceSize base_offset, uint32_t texel_bytes,
                              VkImage src_image) {
-        uint32_t cur_offset = base_offset;
+        VkDeviceSize slot_bytes =
+            fb_cfg.imgWidth * fb_cfg.imgHeight * texel_bytes;
+        VkDeviceSize cur_offset = base_offset + mini_batch_offset * slot_bytes;
+        uint32_t num_regions = 0;
+
+        for (uint32_t batch_idx = mini_batch_offset;
+             batch_idx < mini_batch_offset + fb_cfg.miniBatchSize;
+             batch_idx++) {
+            if (!state.copiedEnvs[batch_idx]) {
+                if (backend_cfg.zeroInactiveOutputs &&
+                    !state.skippedEnvs[batch_idx]) {
+                    dev.dt.cmdFillBuffer(copy_cmd, fb.resultBuffer.buffer,
+                                         cur_offset, slot_bytes, 0);
+                }
+
+                cur_offset += slot_bytes;
+                continue;
+            }
 
-        for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
             glm::u32vec2 cur_fb_pos = state.batchFBOffsets[batch_idx];
 
-            VkBufferImageCopy &region = copy_regions[batch_idx];
+            VkBufferImageCopy &region = copy_regions[num_regions++];
             region.bufferOffset = cur_offset;
             region.bufferRowLength = 0;
             region.bufferImageHeight = 0;
-            region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+            region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0,
+                                       state.batchFBLayers[batch_idx], 1};
             region.imageOffset = {static_cast<int32_t>(cur_fb_pos.x),
                                   static_cast<int32_t>(cur_fb_pos.y), 0};
             region.imageExtent = {fb_cfg.imgWidth, fb_cfg.imgHeight, 1};
 
-            cur_offset += fb_cfg.imgWidth * fb_cfg.imgHeight * texel_bytes;
+            cur_offset += slot_bytes;
         }
 
-        dev.dt.cmdCopyImageToBuffer(
-            copy_cmd, src_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-            fb.resultBuffer.buffer, batch_size, copy_regions.data());
+        if (num_regions > 0) {
+            dev.dt.cmdCopyImageToBuffer(
+                copy_cmd, src_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                fb.resultBuffer.buffer, num_regions, copy_regions.data());
+        }
     };
 
-    uint32_t attachment_offset = 0;
-    if (backend_cfg.colorOutput) {
-        make_copy_cmd(state.colorBufferOffset, sizeof(uint8_t) * 4,
-                      fb.attachments[attachment_offset].image);
+    VkCommandBufferInheritanceInfo inheritance_info {};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
 
-        attachment_offset++;
-    }
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.pInheritanceInfo = &inheritance_info;
 
-    if (backend_cfg.depthOutput) {
-        make_copy_cmd(state.depthBufferOffset, sizeof(float),
-                      fb.attachments[attachment_offset].image);
+    for (uint32_t mini_batch_idx = 0;
+         mini_batch_idx < state.copyCommands.size(); mini_batch_idx++) {
+        VkCommandBuffer copy_cmd = state.copyCommands[mini_batch_idx];
+        uint32_t mini_batch_offset = mini_batch_idx * fb_cfg.miniBatchSize;
+
+        REQ_VK(dev.dt.beginCommandBuffer(copy_cmd, &begin_info));
+
+        uint32_t attachment_offset = 0;
+        if (backend_cfg.colorOutput) {
+            make_copy_cmd(copy_cmd, mini_batch_offset, state.colorBufferOffset,
+                          sizeof(uint8_t) * 4,
+                          fb.attachments[attachment_offset].image);
+
+            attachment_offset++;
+        }
 
-        attachment_offset++;
+        if (backend_cfg.depthOutput) {
+            make_copy_cmd(copy_cmd, mini_batch_offset, state.depthBufferOffset,
+                          sizeof(float),
+                          fb.attachments[attachment_offset].image);
+
+            attachment_offset++;
+        }
+
+        REQ_VK(dev.dt.endCommandBuffer(copy_cmd));
     }
+}
 
-    REQ_VK(dev.dt.endCommandBuffer(copy_cmd));
+static uint32_t getCullQueueFamily(const DeviceState &dev,
+                                   const BackendConfig &backend_cfg)
+{
+    return backend_cfg.asyncCompute ? dev.computeQF : dev.gfxQF;
+}
+
+// Render commands are recorded in slices of up to record_envs_per_task
+// envs, in parallel
+static uint32_t getSlicesPerMiniBatch(uint32_t mini_batch_size)
+{
+    return (mini_batch_size + VulkanConfig::record_envs_per_task - 1) /
+           VulkanConfig::record_envs_per_task;
 }
 
 static PerBatchState makePerBatchState(const DeviceState &dev,
                                        const BackendConfig &backend_cfg,
                                        const FramebufferConfig &fb_cfg,
+                                       const FramebufferState &fb,
                                        const ParamBufferConfig &param_cfg,
                                        VkCommandPool gfx_cmd_pool,
+                                       VkCommandPool cull_cmd_pool,
                                        HostBuffer &param_buffer,
                                        LocalBuffer &indirect_buffer,
+                                       const LocalBuffer *instance_buffer,
                                        VkDescriptorSet cull_set,
                                        VkDescriptorSet draw_set,
+                                       VkDescriptorSet scatter_set,
+                                       VkDescriptorSet expand_set,
                                        uint32_t batch_size,
                                        uint32_t global_batch_idx)
 {
-    auto computeFBPosition = [&fb_cfg](uint32_t batch_idx) {
+    uint32_t images_per_layer =
+        fb_cfg.numImagesWidePerLayer * fb_cfg.numImagesTallPerLayer;
+
+    auto computeFBPosition = [&](uint32_t layer_offset) {
         return glm::u32vec2(
-            (batch_idx % fb_cfg.numImagesWidePerBatch) * fb_cfg.imgWidth,
-            (batch_idx / fb_cfg.numImagesWidePerBatch) * fb_cfg.imgHeight);
+            (layer_offset % fb_cfg.numImagesWidePerLayer) * fb_cfg.imgWidth,
+            (layer_offset / fb_cfg.numImagesWidePerLayer) * fb_cfg.imgHeight);
     };
 
+    VkCommandBuffer upload_command = makeCmdBuffer(dev, cull_cmd_pool);
+    VkCommandBuffer cull_command = makeCmdBuffer(dev, cull_cmd_pool);
     VkCommandBuffer draw_command = makeCmdBuffer(dev, gfx_cmd_pool);
-    VkCommandBuffer copy_command = makeCmdBuffer(dev, gfx_cmd_pool);
 
-    glm::u32vec2 base_fb_offset(
-        global_batch_idx * fb_cfg.numImagesWidePerBatch * fb_cfg.imgWidth, 0);
+    uint32_t num_mini_batches = batch_size / fb_cfg.miniBatchSize;
+    DynArray<VkCommandBuffer> copy_commands(num_mini_batches);
+    for (uint32_t mini_batch_idx = 0; mini_batch_idx < num_mini_batches;
+         mini_batch_idx++) {
+        copy_commands[mini_batch_idx] = makeCmdBuffer(
+            dev, gfx_cmd_pool, VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+    }
+
+    uint32_t num_slices =
+        num_mini_batches * getSlicesPerMiniBatch(fb_cfg.miniBatchSize);
+    DynArray<VkCommandPool> cull_pools(num_slices);
+    DynArray<VkCommandPool> draw_pools(num_slices);
+    DynArray<VkCommandBuffer> cull_commands(num_slices);
+    DynArray<VkCommandBuffer> draw_commands(num_slices);
+    for (uint32_t slice_idx = 0; slice_idx < num_slices; slice_idx++) {
+        cull_pools[slice_idx] =
+            makeCmdPool(dev, getCullQueueFamily(dev, backend_cfg));
+        draw_pools[slice_idx] = makeCmdPool(dev, dev.gfxQF);
+        cull_commands[slice_idx] =
+            makeCmdBuffer(dev, cull_pools[slice_idx],
+                          VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+        draw_commands[slice_idx] =
+            makeCmdBuffer(dev, draw_pools[slice_idx],
+                          VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+    }
+
+    DynArray<VkFramebuffer> framebuffers(num_mini_batches);
+    for (uint32_t mini_batch_idx = 0; mini_batch_idx < num_mini_batches;
+         mini_batch_idx++) {
+        framebuffers[mini_batch_idx] =
+            fb.hdls[global_batch_idx * num_mini_batches + mini_batch_idx];
+    }
+
+    // Mini batches are contiguous, so each fills whole layers
+    uint32_t base_fb_layer = global_batch_idx * fb_cfg.numLayersPerBatch;
 
     DynArray<glm::u32vec2> batch_fb_offsets(batch_size);
+    DynArray<uint32_t> batch_fb_layers(batch_size);
     for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         batch_fb_offsets[batch_idx] =
-            computeFBPosition(batch_idx) + base_fb_offset;
+            computeFBPosition(batch_idx % images_per_layer);
+        batch_fb_layers[batch_idx] =
+            base_fb_layer + batch_idx / images_per_layer;
     }
 
     VkDeviceSize color_buffer_offset =
@@ -801,6 +1043,7 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
     uint32_t *material_ptr = nullptr;
     PackedLight *light_ptr = nullptr;
     uint32_t *num_lights_ptr = nullptr;
+    InstanceScatter *scatter_ptr = nullptr;
 
     if (backend_cfg.needMaterials) {
         material_ptr = reinterpret_cast<uint32_t *>(
@@ -822,16 +1065,34 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
     VkDeviceSize draw_indirect_offset =
         base_indirect_offset + param_cfg.drawIndirectOffset;
 
-    DrawInput *draw_ptr =
-        reinterpret_cast<DrawInput *>(base_ptr + param_cfg.cullInputOffset);
+    DrawRange *draw_range_ptr =
+        reinterpret_cast<DrawRange *>(base_ptr + param_cfg.drawRangeOffset);
+
+    CullEnvParams *cull_params_ptr = reinterpret_cast<CullEnvParams *>(
+        base_ptr + param_cfg.cullParamsOffset);
+
+    CullDispatchEnv *cull_dispatch_ptr = reinterpret_cast<CullDispatchEnv *>(
+        base_ptr + param_cfg.cullDispatchOffset);
+
+    // Shaders read instance data from the device-local copy if present
+    VkBuffer instance_hdl = param_buffer.buffer;
+    VkDeviceSize instance_base_offset = base_offset;
+    if (instance_buffer) {
+        instance_hdl = instance_buffer->buffer;
+        instance_base_offset =
+            global_batch_idx * param_cfg.totalInstanceBytes;
 
-    DescriptorUpdates desc_updates(8);
+        scatter_ptr = reinterpret_cast<InstanceScatter *>(
+            base_ptr + param_cfg.scatterInputOffset);
+    }
+
+    DescriptorUpdates desc_updates(17);
 
     // Cull set
 
     VkDescriptorBufferInfo transform_info {
-        param_buffer.buffer,
-        base_offset,
+        instance_hdl,
+        instance_base_offset,
         param_cfg.totalTransformBytes,
     };
 
@@ -839,8 +1100,9 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
                         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
 
     VkDescriptorBufferInfo view_buffer_info {
-        param_buffer.buffer,
-        base_offset + param_cfg.viewOffset,
+        backend_cfg.deviceInputs ? instance_hdl : param_buffer.buffer,
+        (backend_cfg.deviceInputs ? instance_base_offset : base_offset) +
+            param_cfg.viewOffset,
         param_cfg.totalViewBytes,
     };
 
@@ -848,9 +1110,9 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
                         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
 
     VkDescriptorBufferInfo indirect_input_buffer_info {
-        param_buffer.buffer,
-        param_cfg.cullInputOffset,
-        param_cfg.totalCullInputBytes,
+        indirect_buffer.buffer,
+        base_indirect_offset + param_cfg.drawInputOffset,
+        param_cfg.totalDrawInputBytes,
     };
 
     desc_updates.buffer(cull_set, &indirect_input_buffer_info, 2,
@@ -870,6 +1132,24 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
     desc_updates.buffer(cull_set, &indirect_count_buffer_info, 4,
                         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
 
+    VkDescriptorBufferInfo cull_params_info {
+        param_buffer.buffer,
+        base_offset + param_cfg.cullParamsOffset,
+        param_cfg.totalCullParamBytes,
+    };
+
+    desc_updates.buffer(cull_set, &cull_params_info, 5,
+                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
+    VkDescriptorBufferInfo cull_dispatch_info {
+        param_buffer.buffer,
+        base_offset + param_cfg.cullDispatchOffset,
+        param_cfg.totalCullDispatchBytes,
+    };
+
+    desc_updates.buffer(cull_set, &cull_dispatch_info, 6,
+                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
     // Draw set
 
     desc_updates.buffer(draw_set, &view_buffer_info, 0,
@@ -878,11 +1158,14 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
     desc_updates.buffer(draw_set, &transform_info, 1,
                         VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
 
+    desc_updates.buffer(draw_set, &indirect_output_buffer_info, 4,
+                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
     VkDescriptorBufferInfo mat_info;
     if (material_ptr) {
         mat_info = {
-            param_buffer.buffer,
-            base_offset + param_cfg.materialIndicesOffset,
+            instance_hdl,
+            instance_base_offset + param_cfg.materialIndicesOffset,
             param_cfg.totalMaterialIndexBytes,
         };
         desc_updates.buffer(draw_set, &mat_info, 2,
@@ -901,17 +1184,95 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
                             VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
     }
 
+    // Scatter set
+
+    VkDescriptorBufferInfo scatter_info;
+    if (scatter_ptr) {
+        scatter_info = {
+            param_buffer.buffer,
+            base_offset + param_cfg.scatterInputOffset,
+            param_cfg.totalScatterInputBytes,
+        };
+
+        desc_updates.buffer(scatter_set, &scatter_info, 0,
+                            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
+        desc_updates.buffer(scatter_set, &transform_info, 1,
+                            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
+        if (material_ptr) {
+            desc_updates.buffer(scatter_set, &mat_info, 2,
+                                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        }
+    }
+
+    // Expand set
+
+    VkDescriptorBufferInfo draw_range_info {
+        param_buffer.buffer,
+        base_offset + param_cfg.drawRangeOffset,
+        param_cfg.totalDrawRangeBytes,
+    };
+
+    desc_updates.buffer(expand_set, &draw_range_info, 0,
+                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
+    desc_updates.buffer(expand_set, &indirect_input_buffer_info, 1,
+                        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+
     desc_updates.update(dev);
 
-    return PerBatchState {makeFence(dev),
-                          {draw_command, copy_command},
+    // Offsets are compared against the previous frame's, so start zeroed.
+    // envID 0 is never assigned, forcing a full pack on first use.
+    DynArray<uint32_t> input_offsets(batch_size);
+    DynArray<uint32_t> range_offsets(batch_size);
+    DynArray<uint32_t> instance_offsets(batch_size);
+    DynArray<uint32_t> light_offsets(batch_size);
+    DynArray<PackedEnvState> packed_envs(batch_size);
+    DynArray<bool> active_envs(batch_size);
+    DynArray<bool> copied_envs(batch_size);
+    DynArray<bool> skipped_envs(batch_size);
+    DynArray<RecordedSlot> recorded_slots(batch_size);
+    for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        input_offsets[batch_idx] = 0;
+        range_offsets[batch_idx] = 0;
+        instance_offsets[batch_idx] = 0;
+        light_offsets[batch_idx] = 0;
+        packed_envs[batch_idx] = PackedEnvState {};
+        active_envs[batch_idx] = true;
+        copied_envs[batch_idx] = true;
+        skipped_envs[batch_idx] = false;
+        recorded_slots[batch_idx] = RecordedSlot {};
+    }
+
+    return PerBatchState {0,
+                          {upload_command, cull_command, draw_command},
+                          makeBinarySemaphore(dev),
                           count_indirect_offset,
                           sizeof(uint32_t) * batch_size,
                           draw_indirect_offset,
                           DynArray<uint32_t>(batch_size),
                           DynArray<uint32_t>(batch_size),
-                          base_fb_offset,
+                          move(input_offsets),
+                          move(range_offsets),
+                          move(instance_offsets),
+                          move(light_offsets),
+                          move(packed_envs),
+                          move(active_envs),
+                          move(copied_envs),
+                          move(skipped_envs),
+                          0,
+                          move(recorded_slots),
+                          DynArray<uint32_t>(batch_size),
+                          false,
+                          move(cull_pools),
+                          move(draw_pools),
+                          move(cull_commands),
+                          move(draw_commands),
+                          move(copy_commands),
+                          move(framebuffers),
                           move(batch_fb_offsets),
+                          move(batch_fb_layers),
                           color_buffer_offset,
                           depth_buffer_offset,
                           cull_set,
@@ -921,145 +1282,1236 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
                           material_ptr,
                           light_ptr,
                           num_lights_ptr,
-                          draw_ptr};
+                          draw_range_ptr,
+                          cull_params_ptr,
+                          cull_dispatch_ptr,
+                          expand_set,
+                          0,
+                          0,
+                          false,
+                          base_offset,
+                          instance_base_offset,
+                          scatter_set,
+                          scatter_ptr,
+                          {},
+                          0,
+                          false,
+                          0};
 }
 
-VulkanBackend::VulkanBackend(const RenderConfig &cfg, bool validate)
-    : VulkanBackend(cfg, getBackendConfig(cfg), validate)
-{}
-
-VulkanBackend::VulkanBackend(const RenderConfig &cfg,
-                             const BackendConfig &backend_cfg,
-                             bool validate)
-    : batch_size_(cfg.batchSize),
-      inst(validate, false, {}),
-      dev(inst.makeDevice(getUUIDFromCudaID(cfg.gpuID),
-                          false,
-                          2,
-                          1,
-                          cfg.numLoaders,
-                          nullptr)),
-      alloc(dev, inst),
-      fb_cfg_(getFramebufferConfig(cfg, backend_cfg)),
-      param_cfg_(getParamBufferConfig(backend_cfg, cfg.batchSize, alloc)),
-      render_state_(makeRenderState(dev, backend_cfg, alloc)),
-      pipeline_(makePipeline(dev, backend_cfg, fb_cfg_, render_state_)),
-      fb_(makeFramebuffer(dev,
-                          cfg,
-                          backend_cfg,
-                          fb_cfg_,
-                          alloc,
-                          render_state_.renderPass)),
-      transfer_queues_(dev.numTransferQueues),
-      graphics_queues_(dev.numGraphicsQueues),
-      compute_queues_(dev.numComputeQueues),
-      render_input_buffer_(alloc.makeParamBuffer(param_cfg_.totalParamBytes *
-                                                 backend_cfg.numBatches)),
-      indirect_draw_buffer_([&]() {
-          auto opt_buffer = alloc.makeIndirectBuffer(
-              param_cfg_.totalIndirectBytes * backend_cfg.numBatches);
-          if (!opt_buffer.has_value()) {
-              cerr << "Vulkan: Out of device memory during initialization"
-                   << endl;
-          }
-
-          return move(opt_buffer.value());
-      }()),
-      gfx_cmd_pool_(makeCmdPool(dev, dev.gfxQF)),
-      num_loaders_(0),
-      max_loaders_(cfg.numLoaders),
-      need_materials_(backend_cfg.needMaterials),
-      need_lighting_(backend_cfg.needLighting),
-      mini_batch_size_(fb_cfg_.miniBatchSize),
-      num_mini_batches_(batch_size_ / mini_batch_size_),
-      per_elem_render_size_(fb_cfg_.imgWidth, fb_cfg_.imgHeight),
-      per_minibatch_render_size_(
-          per_elem_render_size_.x * fb_cfg_.numImagesWidePerMiniBatch,
-          per_elem_render_size_.y * fb_cfg_.numImagesTallPerMiniBatch),
-      batch_states_(),
-      cur_batch_(0),
-      batch_mask_(backend_cfg.numBatches == 2 ? 1 : 0)
+// The param buffer is never read back on the CPU, so write it with
+// non-temporal stores rather than pulling every line into the cache.
+static inline void streamCopy(void *dst, const void *src, size_t num_bytes)
 {
-    bool transfer_shared = cfg.numLoaders > dev.numTransferQueues;
-
-    for (int i = 0; i < (int)transfer_queues_.size(); i++) {
-        new (&transfer_queues_[i])
-            QueueState(makeQueue(dev, dev.transferQF, i), transfer_shared);
+#ifdef __x86_64__
+    uint8_t *dst_bytes = static_cast<uint8_t *>(dst);
+    const uint8_t *src_bytes = static_cast<const uint8_t *>(src);
+
+    size_t num_head_bytes = min<size_t>(
+        (16 - reinterpret_cast<uintptr_t>(dst_bytes) % 16) % 16, num_bytes);
+    memcpy(dst_bytes, src_bytes, num_head_bytes);
+    dst_bytes += num_head_bytes;
+    src_bytes += num_head_bytes;
+    num_bytes -= num_head_bytes;
+
+    size_t num_vecs = num_bytes / sizeof(__m128i);
+    for (size_t i = 0; i < num_vecs; i++) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(src_bytes) + i);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst_bytes) + i, v);
     }
 
-    for (int i = 0; i < (int)graphics_queues_.size(); i++) {
-        new (&graphics_queues_[i])
-            QueueState(makeQueue(dev, dev.gfxQF, i),
-                       i == (int)graphics_queues_.size() - 1 ? true : false);
-    }
+    size_t num_vec_bytes = num_vecs * sizeof(__m128i);
+    memcpy(dst_bytes + num_vec_bytes, src_bytes + num_vec_bytes,
+           num_bytes - num_vec_bytes);
+#else
+    memcpy(dst, src, num_bytes);
+#endif
+}
 
-    for (int i = 0; i < (int)compute_queues_.size(); i++) {
-        new (&compute_queues_[i])
-            QueueState(makeQueue(dev, dev.computeQF, i), false);
-    }
+static inline void streamFence()
+{
+#ifdef __x86_64__
+    _mm_sfence();
+#endif
+}
+
+// The scene's default instances fill the start of the env's arena and the
+// first numMeshes ranges. While they are shared they are read from the
+// scene's static data, and the env only owns the rest of the arena.
+static inline uint32_t firstOwnedRange(const Environment &env,
+                                       const VulkanScene &scene)
+{
+    return env.sharesStaticInstances() ? scene.numMeshes : 0;
+}
 
-    batch_states_.reserve(backend_cfg.numBatches);
-    for (int i = 0; i < (int)backend_cfg.numBatches; i++) {
-        batch_states_.emplace_back(makePerBatchState(
-            dev, backend_cfg, fb_cfg_, param_cfg_, gfx_cmd_pool_,
-            render_input_buffer_, indirect_draw_buffer_,
-            render_state_.cullPool.makeSet(), render_state_.drawPool.makeSet(),
-            cfg.batchSize, i));
+static inline uint32_t numOwnedInstances(const Environment &env)
+{
+    return env.getTransforms().size() - env.getNumSharedInstances();
+}
 
-        recordFBToLinearCopy(dev, backend_cfg, batch_states_.back(), fb_cfg_,
-                             fb_);
+// Output draws are allocated in power of two blocks, so small changes in
+// an env's draw count don't move the draws of every env after it, which
+// would force the batch's render commands to be rerecorded
+static inline uint32_t drawCapacity(uint32_t num_draws)
+{
+    uint32_t capacity = num_draws > 0 ? 1 : 0;
+    while (capacity < num_draws) {
+        capacity <<= 1;
     }
+
+    return capacity;
 }
 
-LoaderImpl VulkanBackend::makeLoader()
+// Writes the instances named by the tail of env's update log, either
+// directly into the param buffer or as scatter inputs for the GPU
+template <bool need_materials>
+static void packInstanceUpdates(const Environment &env,
+                                const PackedEnvState &packed,
+                                uint32_t inst_offset,
+                                PerBatchState &batch_state)
 {
-    int loader_idx = num_loaders_.fetch_add(1, memory_order_acq_rel);
-    assert(loader_idx < max_loaders_);
-
-    auto loader = new VulkanLoader(
-        dev, alloc, transfer_queues_[loader_idx % transfer_queues_.size()],
-        graphics_queues_.back(), render_state_.cull, render_state_.draw,
-        need_materials_, need_lighting_);
+    const auto &env_transforms = env.getTransforms();
+    [[maybe_unused]] const auto &env_materials = env.getMaterials();
+    const auto &updates = env.getInstanceUpdates();
+
+    // Shared instances are never in the log (modifying one detaches the
+    // env), so every logged index lies in the owned part of the arena
+    uint32_t first_owned = env.getNumSharedInstances();
+
+    uint32_t first_update = updates.size() - packed.numUpdates;
+    for (uint32_t i = 0; i < packed.numUpdates; i++) {
+        uint32_t arena_idx = updates[first_update + i];
+        uint32_t inst_idx = inst_offset + arena_idx - first_owned;
+
+        if (batch_state.scatterPtr) {
+            InstanceScatter scatter;
+            scatter.transform = env_transforms[arena_idx];
+            scatter.instanceIdx = inst_idx;
+            scatter.materialIdx = 0;
+            if constexpr (need_materials) {
+                scatter.materialIdx = env_materials[arena_idx];
+            }
 
-    return makeLoaderImpl<VulkanLoader>(loader);
+            streamCopy(&batch_state.scatterPtr[packed.scatterOffset + i],
+                       &scatter, sizeof(InstanceScatter));
+        } else {
+            batch_state.transformPtr[inst_idx] = env_transforms[arena_idx];
+            if constexpr (need_materials) {
+                batch_state.materialPtr[inst_idx] = env_materials[arena_idx];
+            }
+        }
+    }
 }
 
-EnvironmentImpl VulkanBackend::makeEnvironment(const Camera &cam,
-                                               const shared_ptr<Scene> &scene)
+// Scatters the env already queued, that were reserved and can't be given
+// back, are turned into no-ops
+static void voidInstanceScatters(const PackedEnvState &packed,
+                                 PerBatchState &batch_state)
 {
-    const VulkanScene &vk_scene = *static_cast<VulkanScene *>(scene.get());
-    VulkanEnvironment *environment = new VulkanEnvironment(cam, vk_scene);
-    return makeEnvironmentImpl<VulkanEnvironment>(environment);
+    if (!batch_state.scatterPtr) {
+        return;
+    }
+
+    InstanceScatter scatter {};
+    scatter.instanceIdx = VulkanConfig::void_scatter_idx;
+    for (uint32_t i = 0; i < packed.numUpdates; i++) {
+        streamCopy(&batch_state.scatterPtr[packed.scatterOffset + i],
+                   &scatter, sizeof(InstanceScatter));
+    }
 }
 
-uint32_t VulkanBackend::render(const Environment *envs)
+template <bool need_materials, bool need_lighting>
+static void packEnvironment(const Environment &env,
+                            uint32_t batch_idx,
+                            PerBatchState &batch_state)
 {
-    PerBatchState &batch_state = batch_states_[cur_batch_];
+    const VulkanEnvironment &env_backend =
+        *static_cast<const VulkanEnvironment *>(env.getBackend());
+    PackedEnvState &packed = batch_state.packedEnvs[batch_idx];
+
+    ViewInfo view_info;
+    view_info.projection = env.getCamera().proj;
+    view_info.view = env.getCamera().worldToCamera;
+    streamCopy(&batch_state.viewPtr[batch_idx], &view_info, sizeof(ViewInfo));
+
+    // Skipped slots are still packed, since their data may have moved,
+    // but their culling emits no draws
+    CullEnvParams cull_params {
+        env_backend.frustumBounds,
+        batch_state.skippedEnvs[batch_idx]
+            ? 0
+            : batch_state.maxNumDraws[batch_idx],
+        batch_state.inputOffsets[batch_idx],
+        packed.numStaticDraws,
+    };
+    streamCopy(&batch_state.cullParamsPtr[batch_idx], &cull_params,
+               sizeof(CullEnvParams));
 
-    VkCommandBuffer render_cmd = batch_state.commands[0];
+    uint32_t dirty = packed.dirty;
+    if constexpr (!need_materials) {
+        dirty &= ~PackDirty::materials;
+    }
+    if constexpr (!need_lighting) {
+        dirty &= ~PackDirty::lights;
+    }
 
-    VkCommandBufferBeginInfo begin_info {};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    REQ_VK(dev.dt.beginCommandBuffer(render_cmd, &begin_info));
+    const VulkanScene &scene =
+        *static_cast<const VulkanScene *>(env.getScene().get());
+    uint32_t inst_offset = batch_state.instanceOffsets[batch_idx];
+    uint32_t first_owned = env.getNumSharedInstances();
+    uint32_t num_owned = numOwnedInstances(env);
+
+    // Only one DrawRange per instance range is written, the GPU
+    // expands them into per chunk DrawInputs
+    if (dirty & PackDirty::draws) {
+        const auto &ranges = env.getInstanceRanges();
+        uint32_t draw_id = batch_state.inputOffsets[batch_idx];
+        DrawRange *range_ptr =
+            batch_state.drawRangePtr + batch_state.rangeOffsets[batch_idx];
+
+        for (uint32_t range_idx = firstOwnedRange(env, scene);
+             range_idx < ranges.size(); range_idx++) {
+            const InstanceRange &range = ranges[range_idx];
+            const MeshInfo &mesh_metadata =
+                scene.meshInfo[range_idx % scene.numMeshes];
+
+            DrawRange draw_range {
+                draw_id,
+                inst_offset + range.offset - first_owned,
+                range.count,
+                mesh_metadata.chunkOffset,
+                mesh_metadata.numChunks,
+            };
+            streamCopy(range_ptr++, &draw_range, sizeof(DrawRange));
 
-    dev.dt.cmdBindPipeline(render_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
-                           pipeline_.rasterState.cullPipeline);
+            draw_id += range.count * mesh_metadata.numChunks;
+        }
+    }
 
-    dev.dt.cmdBindDescriptorSets(render_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                 pipeline_.rasterState.cullLayout, 0, 1,
-                                 &batch_state.cullSet, 0, nullptr);
+    // The owned part of the arena is copied whole, including the spare
+    // capacity of each range, so instance indices match arena indices
+    if (dirty & PackDirty::transforms) {
+        streamCopy(batch_state.transformPtr + inst_offset,
+                   env.getTransforms().data() + first_owned,
+                   sizeof(glm::mat4x3) * num_owned);
+    }
 
-    dev.dt.cmdBindPipeline(render_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                           pipeline_.rasterState.drawPipeline);
+    if constexpr (need_materials) {
+        if (dirty & PackDirty::materials) {
+            streamCopy(batch_state.materialPtr + inst_offset,
+                       env.getMaterials().data() + first_owned,
+                       sizeof(uint32_t) * num_owned);
+        }
+    }
 
-    dev.dt.cmdBindDescriptorSets(render_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                 pipeline_.rasterState.drawLayout, 0, 1,
-                                 &batch_state.drawSet, 0, nullptr);
+    // Both set only for envs packed early that then moved. The whole env
+    // is copied, so its scatters must not write the same instances.
+    if (dirty & PackDirty::instances) {
+        if (dirty & PackDirty::transforms) {
+            voidInstanceScatters(packed, batch_state);
+        } else {
+            packInstanceUpdates<need_materials>(env, packed, inst_offset,
+                                                batch_state);
+        }
+    }
 
-    // Reset count buffer
-    dev.dt.cmdFillBuffer(render_cmd, indirect_draw_buffer_.buffer,
-                         batch_state.indirectCountBaseOffset,
-                         batch_state.indirectCountTotalBytes, 0);
+    if constexpr (need_lighting) {
+        if (dirty & PackDirty::lights) {
+            streamCopy(
+                batch_state.lightPtr + batch_state.lightOffsets[batch_idx],
+                env_backend.lights.data(),
+                sizeof(PackedLight) * env_backend.lights.size());
+        }
+    }
+
+    packed.envID = env.getID();
+    packed.version = env.getVersion();
+    packed.dirty = 0;
+}
+
+static PackEnvFn getPackEnvFn(const BackendConfig &backend_cfg)
+{
+    if (backend_cfg.needMaterials) {
+        if (backend_cfg.needLighting) {
+            return packEnvironment<true, true>;
+        } else {
+            return packEnvironment<true, false>;
+        }
+    } else {
+        if (backend_cfg.needLighting) {
+            return packEnvironment<false, true>;
+        } else {
+            return packEnvironment<false, false>;
+        }
+    }
+}
+
+static LocalBuffer makeIndirectDrawBuffer(MemoryAllocator &alloc,
+                                          const ParamBufferConfig &param_cfg,
+                                          uint32_t num_batches)
+{
+    auto opt_buffer =
+        alloc.makeIndirectBuffer(param_cfg.totalIndirectBytes * num_batches);
+    if (!opt_buffer.has_value()) {
+        cerr << "Vulkan: Out of device memory during initialization" << endl;
+        fatalExit();
+    }
+
+    return move(opt_buffer.value());
+}
+
+static LocalBuffer makeInstanceBuffer(MemoryAllocator &alloc,
+                                      const ParamBufferConfig &param_cfg,
+                                      uint32_t num_batches)
+{
+    auto opt_buffer =
+        alloc.makeLocalBuffer(param_cfg.totalInstanceBytes * num_batches);
+    if (!opt_buffer.has_value()) {
+        cerr << "Vulkan: Out of device memory during initialization" << endl;
+        fatalExit();
+    }
+
+    return move(opt_buffer.value());
+}
+
+static void destroyPipelineState(const DeviceState &dev,
+                                 const PipelineState &pipeline)
+{
+    const RasterPipelineState &raster = pipeline.rasterState;
+
+    dev.dt.destroyPipeline(dev.hdl, raster.cullPipeline, nullptr);
+    dev.dt.destroyPipelineLayout(dev.hdl, raster.cullLayout, nullptr);
+    dev.dt.destroyPipeline(dev.hdl, raster.drawPipeline, nullptr);
+    dev.dt.destroyPipelineLayout(dev.hdl, raster.drawLayout, nullptr);
+    dev.dt.destroyPipeline(dev.hdl, raster.scatterPipeline, nullptr);
+    dev.dt.destroyPipelineLayout(dev.hdl, raster.scatterLayout, nullptr);
+    dev.dt.destroyPipeline(dev.hdl, raster.expandPipeline, nullptr);
+    dev.dt.destroyPipelineLayout(dev.hdl, raster.expandLayout, nullptr);
+    dev.dt.destroyPipelineCache(dev.hdl, pipeline.pipelineCache, nullptr);
+}
+
+// Images and buffers are freed by their own destructors
+static void destroyFramebufferHandles(const DeviceState &dev,
+                                      const FramebufferState &fb)
+{
+    for (VkFramebuffer hdl : fb.hdls) {
+        dev.dt.destroyFramebuffer(dev.hdl, hdl, nullptr);
+    }
+
+    for (VkImageView view : fb.attachmentViews) {
+        dev.dt.destroyImageView(dev.hdl, view, nullptr);
+    }
+}
+
+static uint32_t getNumPackWorkers()
+{
+    uint32_t num_threads =
+        min(max(thread::hardware_concurrency(), 1u),
+            VulkanConfig::max_pack_threads);
+
+    return num_threads - 1;
+}
+
+ConfigState::ConfigState(const DeviceState &d,
+                         MemoryAllocator &alloc,
+                         const RenderConfig &cfg,
+                         const BackendConfig &backend_cfg,
+                         const FramebufferLimits &fb_limits,
+                         const RenderState &render_state)
+    : dev(d),
+      batchSize(cfg.batchSize),
+      backendCfg(backend_cfg),
+      fbCfg(getFramebufferConfig(cfg, backend_cfg, fb_limits)),
+      paramCfg(getParamBufferConfig(backend_cfg, cfg.batchSize, alloc)),
+      numBatches(backend_cfg.numBatches),
+      numRenderQueues(backend_cfg.multiQueue ? d.numGraphicsQueues : 1),
+      miniBatchSize(fbCfg.miniBatchSize),
+      numMiniBatches(batchSize / miniBatchSize),
+      slicesPerMiniBatch(getSlicesPerMiniBatch(miniBatchSize)),
+      perMinibatchRenderSize(fbCfg.layerWidth, fbCfg.layerHeight),
+      cullPool(d, render_state.cull, 0, numBatches),
+      drawPool(d, render_state.draw, 0, numBatches),
+      scatterPool(d, render_state.scatter, 0, numBatches),
+      expandPool(d, render_state.expand, 0, numBatches),
+      pipeline(makePipeline(d, backend_cfg, fbCfg, render_state)),
+      fb(makeFramebuffer(d,
+                         cfg,
+                         backend_cfg,
+                         fbCfg,
+                         alloc,
+                         render_state.renderPass)),
+      renderInputBuffer(
+          alloc.makeParamBuffer(paramCfg.totalParamBytes * numBatches)),
+      indirectDrawBuffer(makeIndirectDrawBuffer(alloc, paramCfg, numBatches)),
+      instanceBuffer(backend_cfg.deviceLocalInstances &&
+                             !backend_cfg.deviceInputs
+                         ? make_optional(makeInstanceBuffer(
+                               alloc, paramCfg, numBatches))
+                         : nullopt),
+      instanceExtBuffer(),
+      gfxCmdPool(makeCmdPool(d, d.gfxQF)),
+      cullCmdPool(makeCmdPool(d, getCullQueueFamily(d, backend_cfg))),
+      batchStates(),
+      batchEnvs(batchSize),
+      batchScenes(batchSize),
+      slotStates(batchSize),
+      completionNotifier(d, numBatches)
+{
+    for (atomic_uint32_t &state : slotStates) {
+        new (&state) atomic_uint32_t(SlotState::empty);
+    }
+
+    if (backend_cfg.deviceInputs) {
+        VkDeviceSize num_bytes = paramCfg.totalInstanceBytes * numBatches;
+        auto [buffer, memory] = alloc.makeExportableBuffer(num_bytes);
+
+        instanceBuffer.emplace(move(buffer));
+        instanceExtBuffer.emplace(dev, cfg.gpuID, memory, num_bytes);
+    }
+
+    batchStates.reserve(numBatches);
+    for (int i = 0; i < (int)numBatches; i++) {
+        VkDescriptorSet scatter_set = VK_NULL_HANDLE;
+        if (instanceBuffer.has_value()) {
+            scatter_set = scatterPool.makeSet();
+        }
+
+        batchStates.emplace_back(makePerBatchState(
+            dev, backendCfg, fbCfg, fb, paramCfg, gfxCmdPool, cullCmdPool,
+            renderInputBuffer, indirectDrawBuffer,
+            instanceBuffer.has_value() ? &instanceBuffer.value() : nullptr,
+            cullPool.makeSet(), drawPool.makeSet(), scatter_set,
+            expandPool.makeSet(), batchSize, i));
+
+        recordFBToLinearCopy(dev, backendCfg, batchStates.back(), fbCfg, fb);
+    }
+}
+
+// Buffers, images and descriptor pools are freed by their own
+// destructors. The primary and copy command buffers are freed along with
+// the command pools, and the descriptor sets along with their pools.
+ConfigState::~ConfigState()
+{
+    for (PerBatchState &batch_state : batchStates) {
+        for (uint32_t slice_idx = 0; slice_idx < batch_state.cullPools.size();
+             slice_idx++) {
+            dev.dt.destroyCommandPool(
+                dev.hdl, batch_state.cullPools[slice_idx], nullptr);
+            dev.dt.destroyCommandPool(
+                dev.hdl, batch_state.drawPools[slice_idx], nullptr);
+        }
+
+        dev.dt.destroySemaphore(dev.hdl, batch_state.cullSemaphore, nullptr);
+    }
+
+    dev.dt.destroyCommandPool(dev.hdl, gfxCmdPool, nullptr);
+    dev.dt.destroyCommandPool(dev.hdl, cullCmdPool, nullptr);
+    destroyPipelineState(dev, pipeline);
+    destroyFramebufferHandles(dev, fb);
+}
+
+VulkanBackend::VulkanBackend(const RenderConfig &cfg, bool validate)
+    : VulkanBackend(cfg, getBackendConfig(cfg), validate)
+{}
+
+VulkanBackend::VulkanBackend(const RenderConfig &cfg,
+                             const BackendConfig &backend_cfg,
+                             bool validate)
+    : inst(validate, false, {}),
+      dev(inst.makeDevice(getUUIDFromCudaID(cfg.gpuID),
+                          false,
+                          2,
+                          1,
+                          cfg.numLoaders,
+                          nullptr)),
+      alloc(dev, inst),
+      fb_limits_(getFramebufferLimits(inst, dev.phy)),
+      render_state_(makeRenderState(dev, backend_cfg, alloc)),
+      transfer_queues_(dev.numTransferQueues),
+      graphics_queues_(dev.numGraphicsQueues),
+      compute_queues_(dev.numComputeQueues),
+      input_semaphore_(backend_cfg.deviceInputs
+                           ? makeTimelineExternalSemaphore(dev)
+                           : VK_NULL_HANDLE),
+      num_loaders_(0),
+      max_loaders_(cfg.numLoaders),
+      gpu_id_(cfg.gpuID),
+      need_materials_(backend_cfg.needMaterials),
+      need_lighting_(backend_cfg.needLighting),
+      pack_workers_(getNumPackWorkers()),
+      pack_fn_(getPackEnvFn(backend_cfg)),
+      next_slot_(0),
+      num_scatters_(0),
+      building_(false),
+      frame_timelines_(dev.numGraphicsQueues),
+      last_timeline_value_(0),
+      cfg_state_(make_unique<ConfigState>(
+          dev, alloc, cfg, backend_cfg, fb_limits_, render_state_)),
+      cur_batch_(0)
+{
+    bool transfer_shared = cfg.numLoaders > dev.numTransferQueues;
+
+    for (int i = 0; i < (int)transfer_queues_.size(); i++) {
+        new (&transfer_queues_[i])
+            QueueState(makeQueue(dev, dev.transferQF, i), transfer_shared);
+    }
+
+    for (int i = 0; i < (int)graphics_queues_.size(); i++) {
+        new (&graphics_queues_[i])
+            QueueState(makeQueue(dev, dev.gfxQF, i),
+                       i == (int)graphics_queues_.size() - 1 ? true : false);
+    }
+
+    for (int i = 0; i < (int)compute_queues_.size(); i++) {
+        new (&compute_queues_[i])
+            QueueState(makeQueue(dev, dev.computeQF, i), false);
+    }
+
+    for (VkSemaphore &timeline : frame_timelines_) {
+        timeline = makeTimelineSemaphore(dev);
+    }
+}
+
+// The config state frees its Vulkan objects, which batches still in
+// flight may be using
+VulkanBackend::~VulkanBackend()
+{
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->numBatches;
+         batch_idx++) {
+        waitForFrame(batch_idx);
+    }
+}
+
+uint32_t VulkanBackend::getRenderQueueIdx(uint32_t batch_idx) const
+{
+    return batch_idx % cfg_state_->numRenderQueues;
+}
+
+void VulkanBackend::reconfigure(const RenderConfig &cfg)
+{
+    BackendConfig backend_cfg = getBackendConfig(cfg);
+    const BackendConfig &cur_cfg = cfg_state_->backendCfg;
+
+    // Loaders and loaded scenes are tied to the shaders of the render mode
+    if (backend_cfg.colorOutput != cur_cfg.colorOutput ||
+        backend_cfg.depthOutput != cur_cfg.depthOutput ||
+        backend_cfg.needMaterials != cur_cfg.needMaterials ||
+        backend_cfg.needLighting != cur_cfg.needLighting) {
+        cerr << "Vulkan: reconfigure can't change the render mode" << endl;
+        fatalExit();
+    }
+
+    // The device and its queues are shared with loaders and scenes, and
+    // output buffers are imported into CUDA on this GPU
+    if (cfg.gpuID != gpu_id_) {
+        cerr << "Vulkan: reconfigure can't change the GPU" << endl;
+        fatalExit();
+    }
+
+    if (int(cfg.numLoaders) != max_loaders_) {
+        cerr << "Vulkan: reconfigure can't change the number of loaders"
+             << endl;
+        fatalExit();
+    }
+
+    // The input semaphore may already be imported by the caller
+    if (backend_cfg.deviceInputs != cur_cfg.deviceInputs) {
+        cerr << "Vulkan: reconfigure can't toggle device inputs" << endl;
+        fatalExit();
+    }
+
+    assert(!building_);
+
+    // The old state can't be destroyed while still in use
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->numBatches;
+         batch_idx++) {
+        waitForFrame(batch_idx);
+    }
+
+    // The shaders and render pass only depend on the render mode, and
+    // loaders hold on to the shaders, so they are kept. Everything else
+    // is built from scratch, and only replaces the old state once
+    // complete.
+    auto new_state = make_unique<ConfigState>(dev, alloc, cfg, backend_cfg,
+                                              fb_limits_, render_state_);
+
+    cfg_state_ = move(new_state);
+
+    cur_batch_ = 0;
+}
+
+LoaderImpl VulkanBackend::makeLoader()
+{
+    int loader_idx = num_loaders_.fetch_add(1, memory_order_acq_rel);
+    assert(loader_idx < max_loaders_);
+
+    auto loader = new VulkanLoader(
+        dev, alloc, transfer_queues_[loader_idx % transfer_queues_.size()],
+        graphics_queues_.back(), render_state_.cull, render_state_.draw,
+        need_materials_, need_lighting_);
+
+    return makeLoaderImpl<VulkanLoader>(loader);
+}
+
+EnvironmentImpl VulkanBackend::makeEnvironment(const Camera &cam,
+                                               const shared_ptr<Scene> &scene)
+{
+    const VulkanScene &vk_scene = *static_cast<VulkanScene *>(scene.get());
+    VulkanEnvironment *environment = new VulkanEnvironment(cam, vk_scene);
+    return makeEnvironmentImpl<VulkanEnvironment>(environment);
+}
+
+// Works out what changed in a slot since it was last packed. Draws and
+// instances are only recounted when the topology changed. env is null for
+// inactive slots.
+void VulkanBackend::prepareEnv(const Environment *env,
+                               uint32_t batch_idx,
+                               PerBatchState &batch_state)
+{
+    PackedEnvState &packed = batch_state.packedEnvs[batch_idx];
+    packed.written = 0;
+
+    // Inactive slots take no space, and are fully repacked once they
+    // become active again
+    if (!env) {
+        packed = PackedEnvState {};
+        batch_state.maxNumDraws[batch_idx] = 0;
+        batch_state.skippedEnvs[batch_idx] = false;
+        return;
+    }
+
+    const EnvironmentVersion &version = env->getVersion();
+
+    // The slot's output can be reused if it holds this env, and nothing
+    // that affects the image changed since it was drawn
+    bool output_valid = batch_state.copiedEnvs[batch_idx] ||
+                        batch_state.skippedEnvs[batch_idx];
+    batch_state.skippedEnvs[batch_idx] = output_valid &&
+        packed.envID == env->getID() &&
+        packed.version.topology == version.topology &&
+        packed.version.transforms == version.transforms &&
+        packed.version.materials == version.materials &&
+        packed.version.lights == version.lights &&
+        packed.version.camera == version.camera;
+
+    uint32_t dirty = 0;
+    if (packed.envID != env->getID() ||
+        packed.version.topology != version.topology) {
+        const VulkanScene &scene =
+            *static_cast<const VulkanScene *>(env->getScene().get());
+        const auto &ranges = env->getInstanceRanges();
+
+        uint32_t first_range = firstOwnedRange(*env, scene);
+        uint32_t num_draws = 0;
+        for (uint32_t range_idx = first_range; range_idx < ranges.size();
+             range_idx++) {
+            num_draws += ranges[range_idx].count *
+                         scene.meshInfo[range_idx % scene.numMeshes].numChunks;
+        }
+
+        // Instance slots cover the whole owned arena, spare capacity
+        // included
+        packed.numInstances = numOwnedInstances(*env);
+        packed.numInputs = num_draws;
+        packed.numRanges = ranges.size() - first_range;
+        packed.numStaticDraws =
+            env->sharesStaticInstances() ? scene.numStaticDraws : 0;
+        batch_state.maxNumDraws[batch_idx] =
+            packed.numStaticDraws + num_draws;
+
+        dirty = PackDirty::all;
+    } else {
+        if (packed.version.transforms != version.transforms) {
+            dirty |= PackDirty::transforms;
+        }
+
+        if (packed.version.materials != version.materials) {
+            dirty |= PackDirty::materials;
+        }
+
+        if (packed.version.lights != version.lights) {
+            dirty |= PackDirty::lights;
+        }
+
+        // Replay the update log when it reaches back far enough and is
+        // smaller than the environment itself
+        uint32_t num_updates =
+            (version.transforms + version.materials) -
+            (packed.version.transforms + packed.version.materials);
+
+        if (num_updates > 0 &&
+            num_updates <= env->getInstanceUpdates().size() &&
+            num_updates < packed.numInstances) {
+            dirty &= ~(PackDirty::transforms | PackDirty::materials);
+            dirty |= PackDirty::instances;
+            packed.numUpdates = num_updates;
+        }
+    }
+
+    if (need_lighting_) {
+        const VulkanEnvironment &env_backend =
+            *static_cast<const VulkanEnvironment *>(env->getBackend());
+        packed.numLights = env_backend.lights.size();
+    }
+
+    packed.dirty = dirty;
+}
+
+void VulkanBackend::packInputs(PerBatchState &batch_state)
+{
+    uint32_t num_tasks =
+        (cfg_state_->batchSize + VulkanConfig::pack_envs_per_task - 1) /
+        VulkanConfig::pack_envs_per_task;
+
+    auto task_range = [this](uint32_t task_idx) {
+        uint32_t begin = task_idx * VulkanConfig::pack_envs_per_task;
+        uint32_t end = min(begin + VulkanConfig::pack_envs_per_task,
+                           cfg_state_->batchSize);
+
+        return pair(begin, end);
+    };
+
+    // Slots set through setEnvironment were already prepared by their
+    // simulator thread
+    pack_workers_.run(num_tasks, [&](uint32_t task_idx) {
+        auto [begin, end] = task_range(task_idx);
+
+        for (uint32_t batch_idx = begin; batch_idx < end; batch_idx++) {
+            if (cfg_state_->slotStates[batch_idx].load(memory_order_relaxed) <
+                SlotState::prepared) {
+                prepareEnv(cfg_state_->batchEnvs[batch_idx], batch_idx,
+                           batch_state);
+            }
+        }
+    });
+
+    layoutInputs(batch_state);
+
+    // Envs packed ahead of time only need packing again if they moved
+    pack_workers_.run(num_tasks, [&](uint32_t task_idx) {
+        auto [begin, end] = task_range(task_idx);
+
+        for (uint32_t batch_idx = begin; batch_idx < end; batch_idx++) {
+            if (!batch_state.activeEnvs[batch_idx]) {
+                continue;
+            }
+
+            if (cfg_state_->slotStates[batch_idx].load(memory_order_relaxed) ==
+                    SlotState::packed &&
+                batch_state.packedEnvs[batch_idx].dirty == 0) {
+                continue;
+            }
+
+            pack_fn_(*cfg_state_->batchEnvs[batch_idx], batch_idx,
+                     batch_state);
+        }
+
+        // Make the non-temporal stores visible before the batch is
+        // submitted
+        streamFence();
+    });
+}
+
+void VulkanBackend::layoutInputs(PerBatchState &batch_state)
+{
+    // Exclusive prefix sum of the counts gives each env's write offsets.
+    // Any env whose data moved must be repacked even if it didn't change,
+    // including envs their simulator thread already packed.
+    uint32_t total_inputs = 0;
+    uint32_t total_ranges = 0;
+    uint32_t total_instances = 0;
+    uint32_t total_lights = 0;
+    uint32_t num_lights = 0;
+    uint32_t total_scatters = num_scatters_.load(memory_order_relaxed);
+    bool expand_draws = false;
+    batch_state.instanceUploads.clear();
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        PackedEnvState &packed = batch_state.packedEnvs[batch_idx];
+
+        if (batch_state.inputOffsets[batch_idx] != total_inputs ||
+            batch_state.rangeOffsets[batch_idx] != total_ranges ||
+            batch_state.instanceOffsets[batch_idx] != total_instances) {
+            packed.dirty |= PackDirty::all & ~PackDirty::lights;
+            packed.dirty &= ~PackDirty::instances;
+
+            // Scatters that were already queued would write the instances
+            // the whole env copy now covers, so they are voided in place
+            packed.dirty |= packed.written & PackDirty::instances;
+        }
+
+        bool active = batch_state.activeEnvs[batch_idx];
+        if (!active) {
+            packed.dirty = 0;
+        }
+
+        uint32_t changed = packed.dirty | packed.written;
+        expand_draws |= (changed & PackDirty::draws) != 0;
+
+        if (cfg_state_->instanceBuffer.has_value()) {
+            if ((packed.dirty & PackDirty::instances) &&
+                !(packed.written & PackDirty::instances)) {
+                if (total_scatters + packed.numUpdates <=
+                    VulkanConfig::max_instance_scatters) {
+                    packed.scatterOffset = total_scatters;
+                    total_scatters += packed.numUpdates;
+                } else {
+                    packed.dirty &= ~PackDirty::instances;
+                    packed.dirty |= PackDirty::transforms;
+                }
+            }
+
+            // Whole environments are staged through the host-side
+            // instance data, merging uploads of neighbouring slots
+            if (packed.dirty &
+                (PackDirty::transforms | PackDirty::materials)) {
+                packed.dirty |= PackDirty::transforms | PackDirty::materials;
+            }
+
+            if ((packed.dirty | packed.written) &
+                (PackDirty::transforms | PackDirty::materials)) {
+                auto &uploads = batch_state.instanceUploads;
+                if (!uploads.empty() &&
+                    uploads.back().first + uploads.back().second ==
+                        total_instances) {
+                    uploads.back().second += packed.numInstances;
+                } else if (packed.numInstances > 0) {
+                    uploads.emplace_back(total_instances,
+                                         packed.numInstances);
+                }
+            }
+        }
+
+        batch_state.inputOffsets[batch_idx] = total_inputs;
+        total_inputs += packed.numInputs;
+
+        batch_state.rangeOffsets[batch_idx] = total_ranges;
+        total_ranges += packed.numRanges;
+
+        batch_state.instanceOffsets[batch_idx] = total_instances;
+        total_instances += packed.numInstances;
+
+        if (need_lighting_) {
+            if (active &&
+                batch_state.lightOffsets[batch_idx] != total_lights) {
+                packed.dirty |= PackDirty::lights;
+            }
+
+            // The shader loops over a single light count, the last
+            // active env's, but inactive slots take up no lights
+            uint32_t slot_lights = active ? packed.numLights : 0;
+            if (active) {
+                num_lights = slot_lights;
+            }
+            batch_state.lightOffsets[batch_idx] = total_lights;
+            total_lights += slot_lights;
+        }
+    }
+
+    if (total_lights > VulkanConfig::max_lights) {
+        cerr << "Vulkan: Batch has " << total_lights << " lights, only "
+             << VulkanConfig::max_lights << " are supported" << endl;
+        fatalExit();
+    }
+
+    assert(total_inputs < VulkanConfig::max_instances);
+    assert(total_ranges <= VulkanConfig::max_draw_ranges);
+    assert(total_instances < VulkanConfig::max_instances);
+
+    batch_state.numInstanceScatters = total_scatters;
+    batch_state.numDrawRanges = total_ranges;
+    batch_state.numDrawInputs = total_inputs;
+    batch_state.expandDraws = expand_draws && total_inputs > 0;
+
+    if (need_lighting_) {
+        *batch_state.numLightsPtr = num_lights;
+    }
+}
+
+void VulkanBackend::recordDrawExpansion(VkCommandBuffer cmd,
+                                        const PerBatchState &batch_state)
+{
+    const RasterPipelineState &raster = cfg_state_->pipeline.rasterState;
+
+    dev.dt.cmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                           raster.expandPipeline);
+
+    dev.dt.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                 raster.expandLayout, 0, 1,
+                                 &batch_state.expandSet, 0, nullptr);
+
+    ExpandPushConstant expand_const {
+        batch_state.numDrawRanges,
+        batch_state.numDrawInputs,
+    };
+
+    dev.dt.cmdPushConstants(cmd, raster.expandLayout,
+                            VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                            sizeof(ExpandPushConstant), &expand_const);
+
+    dev.dt.cmdDispatch(cmd, getWorkgroupSize(batch_state.numDrawInputs), 1,
+                       1);
+}
+
+// Also orders any draw expansion recorded before it ahead of culling
+void VulkanBackend::recordInstanceUploads(VkCommandBuffer cmd,
+                                          const PerBatchState &batch_state)
+{
+    const RasterPipelineState &raster = cfg_state_->pipeline.rasterState;
+
+    const auto &uploads = batch_state.instanceUploads;
+    uint32_t num_scatters = batch_state.numInstanceScatters;
+
+    // Copies and scatters never touch the same instances, so they can
+    // share a single barrier
+    if (!uploads.empty()) {
+        uint32_t num_copies = uploads.size() * (need_materials_ ? 2 : 1);
+        DynArray<VkBufferCopy> copies(num_copies);
+
+        uint32_t copy_idx = 0;
+        for (auto [inst_offset, num_instances] : uploads) {
+            VkDeviceSize transform_offset =
+                sizeof(glm::mat4x3) * inst_offset;
+
+            copies[copy_idx++] = {
+                batch_state.paramBaseOffset + transform_offset,
+                batch_state.instanceBaseOffset + transform_offset,
+                sizeof(glm::mat4x3) * num_instances,
+            };
+
+            if (need_materials_) {
+                VkDeviceSize material_offset =
+                    cfg_state_->paramCfg.materialIndicesOffset +
+                    sizeof(uint32_t) * inst_offset;
+
+                copies[copy_idx++] = {
+                    batch_state.paramBaseOffset + material_offset,
+                    batch_state.instanceBaseOffset + material_offset,
+                    sizeof(uint32_t) * num_instances,
+                };
+            }
+        }
+
+        dev.dt.cmdCopyBuffer(cmd, cfg_state_->renderInputBuffer.buffer,
+                             cfg_state_->instanceBuffer->buffer, num_copies,
+                             copies.data());
+    }
+
+    if (batch_state.uploadViews) {
+        VkBufferCopy view_copy {
+            batch_state.paramBaseOffset + cfg_state_->paramCfg.viewOffset,
+            batch_state.instanceBaseOffset + cfg_state_->paramCfg.viewOffset,
+            sizeof(ViewInfo) * cfg_state_->batchSize,
+        };
+
+        dev.dt.cmdCopyBuffer(cmd, cfg_state_->renderInputBuffer.buffer,
+                             cfg_state_->instanceBuffer->buffer, 1,
+                             &view_copy);
+    }
+
+    if (num_scatters > 0) {
+        dev.dt.cmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                               raster.scatterPipeline);
+
+        dev.dt.cmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                     raster.scatterLayout, 0,
+                                     1, &batch_state.scatterSet, 0, nullptr);
+
+        ScatterPushConstant scatter_const {num_scatters};
+
+        dev.dt.cmdPushConstants(cmd, raster.scatterLayout,
+                                VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                sizeof(ScatterPushConstant), &scatter_const);
+
+        dev.dt.cmdDispatch(cmd, getWorkgroupSize(num_scatters), 1, 1);
+    }
+
+    VkMemoryBarrier upload_barrier;
+    upload_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    upload_barrier.pNext = nullptr;
+    upload_barrier.srcAccessMask =
+        VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    upload_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    // Uploads run on the cull queue, so only culling needs a barrier.
+    // Drawing is ordered after them by the cull semaphore.
+    dev.dt.cmdPipelineBarrier(
+        cmd,
+        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &upload_barrier, 0,
+        nullptr, 0, nullptr);
+}
+
+void VulkanBackend::scheduleRecordOrder(PerBatchState &batch_state)
+{
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        batch_state.recordOrder[batch_idx] = batch_idx;
+    }
+
+    // Slots can't leave their mini batch, since each mini batch is its own
+    // render pass over its part of the framebuffer. Inactive slots (scene
+    // 0) are moved to the end where they are skipped.
+    auto scene_order = [&](uint32_t a, uint32_t b) {
+        uint64_t scene_a = batch_state.recordedSlots[a].sceneID;
+        uint64_t scene_b = batch_state.recordedSlots[b].sceneID;
+
+        return make_tuple(scene_a == 0, scene_a, a) <
+               make_tuple(scene_b == 0, scene_b, b);
+    };
+
+    for (uint32_t mini_batch_idx = 0;
+         mini_batch_idx < cfg_state_->numMiniBatches; mini_batch_idx++) {
+        uint32_t *mini_batch_order = batch_state.recordOrder.data() +
+            mini_batch_idx * cfg_state_->miniBatchSize;
+
+        sort(mini_batch_order, mini_batch_order + cfg_state_->miniBatchSize,
+             scene_order);
+    }
+
+    // Output draws are laid out in record order, so each run of slots
+    // sharing a scene can be drawn by one indirect draw. They include the
+    // scene's shared static draws.
+    uint32_t total_draws = 0;
+    for (uint32_t order_idx = 0; order_idx < cfg_state_->batchSize;
+         order_idx++) {
+        uint32_t batch_idx = batch_state.recordOrder[order_idx];
+
+        batch_state.drawOffsets[batch_idx] = total_draws;
+        total_draws += batch_state.recordedSlots[batch_idx].drawCapacity;
+    }
+
+    assert(total_draws <= VulkanConfig::max_instances);
+}
+
+void VulkanBackend::recordRenderSlice(const PerBatchState &batch_state,
+                                      uint32_t slice_idx)
+{
+    const RasterPipelineState &raster = cfg_state_->pipeline.rasterState;
+
+    uint32_t mini_batch_idx = slice_idx / cfg_state_->slicesPerMiniBatch;
+    uint32_t slice_begin = mini_batch_idx * cfg_state_->miniBatchSize +
+        (slice_idx % cfg_state_->slicesPerMiniBatch) *
+            VulkanConfig::record_envs_per_task;
+    uint32_t slice_end =
+        min(slice_begin + VulkanConfig::record_envs_per_task,
+            (mini_batch_idx + 1) * cfg_state_->miniBatchSize);
+
+    // Each run of consecutive slots drawing the same scene is culled by a
+    // single dispatch and drawn by a single indirect draw. Culling threads
+    // find their env in the dispatch table, and the vertex shader finds it
+    // in the draw command.
+    struct SceneRun {
+        const VulkanScene *scene;
+        CullPushConstant cullConst;
+        uint32_t numWorkgroups;
+        uint32_t maxNumDraws;
+    };
+
+    DynArray<SceneRun> runs(slice_end - slice_begin);
+    uint32_t num_runs = 0;
+
+    for (uint32_t order_idx = slice_begin; order_idx < slice_end;
+         order_idx++) {
+        uint32_t batch_idx = batch_state.recordOrder[order_idx];
+        if (!batch_state.activeEnvs[batch_idx]) {
+            continue;
+        }
+
+        const VulkanScene *scene = cfg_state_->batchScenes[batch_idx];
+
+        if (num_runs == 0 || runs[num_runs - 1].scene != scene) {
+            runs[num_runs++] = SceneRun {
+                scene,
+                {order_idx, 0, batch_state.drawOffsets[batch_idx]},
+                0,
+                0,
+            };
+        }
+
+        SceneRun &run = runs[num_runs - 1];
+
+        // Active slots come first in record order, and their draws are
+        // laid out in record order, so runs are contiguous in both
+        assert(order_idx ==
+               run.cullConst.firstEnv + run.cullConst.numEnvs);
+        assert(batch_state.drawOffsets[batch_idx] ==
+               run.cullConst.baseDrawID + run.maxNumDraws);
+
+        batch_state.cullDispatchPtr[order_idx] = CullDispatchEnv {
+            batch_idx,
+            run.numWorkgroups,
+        };
+
+        uint32_t draw_capacity =
+            batch_state.recordedSlots[batch_idx].drawCapacity;
+
+        run.cullConst.numEnvs++;
+        run.numWorkgroups += getWorkgroupSize(draw_capacity);
+        run.maxNumDraws += draw_capacity;
+    }
+
+    // Secondary command buffers inherit no state, so both rebind
+    // everything they use
+    VkCommandBuffer cull_cmd = batch_state.cullCommands[slice_idx];
+
+    VkCommandBufferInheritanceInfo cull_inheritance {};
+    cull_inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+
+    VkCommandBufferBeginInfo cull_begin_info {};
+    cull_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cull_begin_info.pInheritanceInfo = &cull_inheritance;
+    REQ_VK(dev.dt.beginCommandBuffer(cull_cmd, &cull_begin_info));
+
+    dev.dt.cmdBindPipeline(cull_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                           raster.cullPipeline);
+
+    dev.dt.cmdBindDescriptorSets(cull_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                 raster.cullLayout, 0, 1,
+                                 &batch_state.cullSet, 0, nullptr);
+
+    for (uint32_t run_idx = 0; run_idx < num_runs; run_idx++) {
+        const SceneRun &run = runs[run_idx];
+        if (run.numWorkgroups == 0) {
+            continue;
+        }
+
+        dev.dt.cmdBindDescriptorSets(
+            cull_cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+            raster.cullLayout, 1, 1, &run.scene->cullSet.hdl,
+            0, nullptr);
+
+        dev.dt.cmdPushConstants(cull_cmd, raster.cullLayout,
+                                VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                sizeof(CullPushConstant), &run.cullConst);
+
+        dev.dt.cmdDispatch(cull_cmd, run.numWorkgroups, 1, 1);
+    }
+
+    REQ_VK(dev.dt.endCommandBuffer(cull_cmd));
+
+    VkCommandBuffer draw_cmd = batch_state.drawCommands[slice_idx];
+
+    VkCommandBufferInheritanceInfo draw_inheritance {};
+    draw_inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    draw_inheritance.renderPass = render_state_.renderPass;
+    draw_inheritance.subpass = 0;
+    draw_inheritance.framebuffer = batch_state.framebuffers[mini_batch_idx];
+
+    VkCommandBufferBeginInfo draw_begin_info {};
+    draw_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    draw_begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    draw_begin_info.pInheritanceInfo = &draw_inheritance;
+    REQ_VK(dev.dt.beginCommandBuffer(draw_cmd, &draw_begin_info));
+
+    dev.dt.cmdBindPipeline(draw_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                           raster.drawPipeline);
+
+    dev.dt.cmdBindDescriptorSets(draw_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                 raster.drawLayout, 0, 1,
+                                 &batch_state.drawSet, 0, nullptr);
+
+    // The vertex shader places each env's output within the layer
+    DrawPushConstant draw_const {
+        cfg_state_->fbCfg.numImagesWidePerLayer,
+        cfg_state_->fbCfg.numImagesTallPerLayer,
+        cfg_state_->fbCfg.numLayersPerMiniBatch,
+    };
+
+    dev.dt.cmdPushConstants(draw_cmd, raster.drawLayout,
+                            VK_SHADER_STAGE_VERTEX_BIT, 0,
+                            sizeof(DrawPushConstant), &draw_const);
+
+    VkViewport viewport;
+    viewport.x = 0;
+    viewport.y = 0;
+    viewport.width = cfg_state_->perMinibatchRenderSize.x;
+    viewport.height = cfg_state_->perMinibatchRenderSize.y;
+    viewport.minDepth = 0.f;
+    viewport.maxDepth = 1.f;
+    dev.dt.cmdSetViewport(draw_cmd, 0, 1, &viewport);
+
+    for (uint32_t run_idx = 0; run_idx < num_runs; run_idx++) {
+        const SceneRun &run = runs[run_idx];
+        if (run.maxNumDraws == 0) {
+            continue;
+        }
+
+        const VulkanScene &scene = *run.scene;
+
+        dev.dt.cmdBindDescriptorSets(
+            draw_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+            raster.drawLayout, 1, 1, &scene.drawSet.hdl, 0,
+            nullptr);
+
+        dev.dt.cmdBindIndexBuffer(draw_cmd, scene.data.buffer,
+                                  scene.indexOffset, VK_INDEX_TYPE_UINT32);
+
+        VkDeviceSize indirect_offset =
+            batch_state.indirectBaseOffset +
+            run.cullConst.baseDrawID * sizeof(DrawCommand);
+
+        VkDeviceSize count_offset = batch_state.indirectCountBaseOffset +
+                                    run.cullConst.firstEnv * sizeof(uint32_t);
+
+        dev.dt.cmdDrawIndexedIndirectCountKHR(
+            draw_cmd, cfg_state_->indirectDrawBuffer.buffer, indirect_offset,
+            cfg_state_->indirectDrawBuffer.buffer, count_offset,
+            run.maxNumDraws, sizeof(DrawCommand));
+    }
+
+    REQ_VK(dev.dt.endCommandBuffer(draw_cmd));
+}
+
+void VulkanBackend::recordRenderSlices(PerBatchState &batch_state)
+{
+    scheduleRecordOrder(batch_state);
+
+    uint32_t num_slices =
+        cfg_state_->numMiniBatches * cfg_state_->slicesPerMiniBatch;
+
+    pack_workers_.run(num_slices, [&](uint32_t slice_idx) {
+        recordRenderSlice(batch_state, slice_idx);
+    });
+}
+
+// Rerecording a secondary invalidates the primaries that execute it, so
+// this follows any change to the render slices or output copies
+void VulkanBackend::recordBatchCommands(PerBatchState &batch_state)
+{
+    // Mini batches with nothing to render, because every slot is inactive
+    // or skipped, skip their render pass, including the framebuffer clear.
+    // Their copies still run, in case inactive outputs are being zeroed.
+    DynArray<bool> mini_batch_active(cfg_state_->numMiniBatches);
+    for (uint32_t mini_batch_idx = 0;
+         mini_batch_idx < cfg_state_->numMiniBatches; mini_batch_idx++) {
+        uint32_t global_batch_offset =
+            mini_batch_idx * cfg_state_->miniBatchSize;
+
+        bool any_active = false;
+        for (uint32_t local_batch_idx = 0;
+             local_batch_idx < cfg_state_->miniBatchSize; local_batch_idx++) {
+            any_active |=
+                batch_state.copiedEnvs[global_batch_offset + local_batch_idx];
+        }
+
+        mini_batch_active[mini_batch_idx] = any_active;
+    }
+
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    // Culling runs on the cull queue. Rendering waits on the cull
+    // semaphore rather than a barrier, so culling for this batch can run
+    // while the graphics queue is still drawing the previous one.
+    VkCommandBuffer cull_cmd = batch_state.commands[1];
+    REQ_VK(dev.dt.beginCommandBuffer(cull_cmd, &begin_info));
+
+    // Reset count buffer
+    dev.dt.cmdFillBuffer(cull_cmd, cfg_state_->indirectDrawBuffer.buffer,
+                         batch_state.indirectCountBaseOffset,
+                         batch_state.indirectCountTotalBytes, 0);
 
     VkBufferMemoryBarrier init_barrier;
     init_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
@@ -1067,255 +2519,744 @@ uint32_t VulkanBackend::render(const Environment *envs)
     init_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
     init_barrier.dstAccessMask =
         VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
-    init_barrier.srcQueueFamilyIndex = 0;
-    init_barrier.dstQueueFamilyIndex = 0;
-    init_barrier.buffer = indirect_draw_buffer_.buffer;
+    init_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    init_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    init_barrier.buffer = cfg_state_->indirectDrawBuffer.buffer;
     init_barrier.offset = 0;
     init_barrier.size = VK_WHOLE_SIZE;
 
-    dev.dt.cmdPipelineBarrier(render_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+    dev.dt.cmdPipelineBarrier(cull_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
                               VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0,
                               nullptr, 1, &init_barrier, 0, nullptr);
 
-    // CPU-side input setup
+    for (uint32_t mini_batch_idx = 0;
+         mini_batch_idx < cfg_state_->numMiniBatches; mini_batch_idx++) {
+        if (!mini_batch_active[mini_batch_idx]) {
+            continue;
+        }
 
-    uint32_t draw_id = 0;
-    uint32_t inst_offset = 0;
-    glm::mat4x3 *transform_ptr = batch_state.transformPtr;
-    uint32_t *material_ptr = batch_state.materialPtr;
-    PackedLight *light_ptr = batch_state.lightPtr;
-    ViewInfo *view_ptr = batch_state.viewPtr;
-    for (int batch_idx = 0; batch_idx < (int)batch_size_; batch_idx++) {
-        const Environment &env = envs[batch_idx];
-        const VulkanEnvironment &env_backend =
-            *static_cast<const VulkanEnvironment *>(env.getBackend());
-        const VulkanScene &scene =
-            *static_cast<const VulkanScene *>(env.getScene().get());
-        const auto &env_transforms = env.getTransforms();
-        const auto &env_materials = env.getMaterials();
-
-        view_ptr->view = env.getCamera().worldToCamera;
-        view_ptr->projection = env.getCamera().proj;
-        view_ptr++;
-
-        batch_state.drawOffsets[batch_idx] = draw_id;
-
-        for (int mesh_idx = 0; mesh_idx < (int)scene.numMeshes; mesh_idx++) {
-            const MeshInfo &mesh_metadata = scene.meshInfo[mesh_idx];
-            uint32_t num_instances = env_transforms[mesh_idx].size();
-
-            for (uint32_t inst_idx = 0; inst_idx < num_instances; inst_idx++) {
-                for (uint32_t chunk_id = 0; chunk_id < mesh_metadata.numChunks;
-                     chunk_id++) {
-                    batch_state.drawPtr[draw_id] = DrawInput {
-                        inst_idx + inst_offset,
-                        chunk_id + mesh_metadata.chunkOffset,
-                    };
-                    draw_id++;
-                }
+        uint32_t first_slice = mini_batch_idx * cfg_state_->slicesPerMiniBatch;
+        dev.dt.cmdExecuteCommands(cull_cmd, cfg_state_->slicesPerMiniBatch,
+                                  &batch_state.cullCommands[first_slice]);
+    }
+
+    REQ_VK(dev.dt.endCommandBuffer(cull_cmd));
+
+    VkCommandBuffer render_cmd = batch_state.commands[2];
+    REQ_VK(dev.dt.beginCommandBuffer(render_cmd, &begin_info));
+
+    // The previous submission's copies must finish reading the
+    // attachments before they are redrawn, and writing the output buffer
+    // before it is rewritten
+    VkMemoryBarrier copy_barrier;
+    copy_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    copy_barrier.pNext = nullptr;
+    copy_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    copy_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+    dev.dt.cmdPipelineBarrier(
+        render_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT |
+            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+            VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+        0, 1, &copy_barrier, 0, nullptr, 0, nullptr);
+
+    VkRenderPassBeginInfo render_pass_info;
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.pNext = nullptr;
+    render_pass_info.renderPass = render_state_.renderPass;
+    render_pass_info.clearValueCount =
+        static_cast<uint32_t>(cfg_state_->fbCfg.clearValues.size());
+    render_pass_info.pClearValues = cfg_state_->fbCfg.clearValues.data();
+
+    // 1 indirect draw per batch elem. Each mini batch's outputs are copied
+    // out as soon as it is drawn, overlapping with the following mini
+    // batches.
+    for (uint32_t mini_batch_idx = 0;
+         mini_batch_idx < cfg_state_->numMiniBatches; mini_batch_idx++) {
+        if (!mini_batch_active[mini_batch_idx]) {
+            dev.dt.cmdExecuteCommands(
+                render_cmd, 1, &batch_state.copyCommands[mini_batch_idx]);
+            continue;
+        }
+
+        render_pass_info.framebuffer =
+            batch_state.framebuffers[mini_batch_idx];
+        render_pass_info.renderArea.offset = {0, 0};
+        render_pass_info.renderArea.extent = {
+            cfg_state_->perMinibatchRenderSize.x,
+            cfg_state_->perMinibatchRenderSize.y,
+        };
+
+        dev.dt.cmdBeginRenderPass(
+            render_cmd, &render_pass_info,
+            VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+        uint32_t first_slice = mini_batch_idx * cfg_state_->slicesPerMiniBatch;
+        dev.dt.cmdExecuteCommands(render_cmd, cfg_state_->slicesPerMiniBatch,
+                                  &batch_state.drawCommands[first_slice]);
+
+        dev.dt.cmdEndRenderPass(render_cmd);
+
+        dev.dt.cmdExecuteCommands(render_cmd, 1,
+                                  &batch_state.copyCommands[mini_batch_idx]);
+    }
+    REQ_VK(dev.dt.endCommandBuffer(render_cmd));
+}
+
+uint32_t VulkanBackend::render(const Environment *envs,
+                               uint32_t num_envs,
+                               const bool *active)
+{
+    assert(num_envs <= cfg_state_->batchSize);
+
+    beginBatch();
+
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        bool env_active =
+            batch_idx < num_envs && (!active || active[batch_idx]);
+
+        if (env_active) {
+            cfg_state_->batchEnvs[batch_idx] = &envs[batch_idx];
+        }
+    }
+
+    return submitBatch();
+}
+
+void VulkanBackend::beginBatch()
+{
+    assert(!building_);
+
+    // The batch's buffers and command buffers can't be touched until its
+    // previous submission retires. With enough batches in flight this has
+    // normally happened long ago.
+    waitForFrame(cur_batch_);
+
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        cfg_state_->batchEnvs[batch_idx] = nullptr;
+        cfg_state_->slotStates[batch_idx].store(SlotState::empty,
+                                      memory_order_relaxed);
+    }
+    next_slot_.store(0, memory_order_relaxed);
+    num_scatters_.store(0, memory_order_relaxed);
+
+    building_ = true;
+}
+
+uint32_t VulkanBackend::claimSlot()
+{
+    assert(building_);
+
+    uint32_t slot = next_slot_.fetch_add(1, memory_order_relaxed);
+    assert(slot < cfg_state_->batchSize);
+
+    [[maybe_unused]] uint32_t prev_state =
+        cfg_state_->slotStates[slot].exchange(SlotState::claimed,
+                                              memory_order_relaxed);
+    assert(prev_state == SlotState::empty);
+
+    return slot;
+}
+
+// Runs on simulator threads, each on its own slot. When the slot's
+// layout is unchanged since the batch was last rendered, which is the
+// common case, it is packed at its previous offsets right away. The
+// render thread repacks it if an earlier slot's layout change moved it.
+void VulkanBackend::setEnvironment(uint32_t slot, const Environment &env)
+{
+    assert(building_ && slot < cfg_state_->batchSize);
+
+    PerBatchState &batch_state = cfg_state_->batchStates[cur_batch_];
+    PackedEnvState &packed = batch_state.packedEnvs[slot];
+
+    cfg_state_->batchEnvs[slot] = &env;
+
+    uint32_t prev_num_lights = packed.numLights;
+    prepareEnv(&env, slot, batch_state);
+
+    uint32_t state = SlotState::prepared;
+    if (!(packed.dirty & PackDirty::draws) &&
+        packed.numLights == prev_num_lights) {
+        // Once the scatter space runs out, whole environments are
+        // uploaded instead
+        if (cfg_state_->instanceBuffer.has_value()) {
+            if (packed.dirty & PackDirty::instances) {
+                uint32_t offset = num_scatters_.load(memory_order_relaxed);
+                do {
+                    if (offset + packed.numUpdates >
+                        VulkanConfig::max_instance_scatters) {
+                        packed.dirty &= ~PackDirty::instances;
+                        packed.dirty |= PackDirty::transforms;
+                        break;
+                    }
+
+                    packed.scatterOffset = offset;
+                } while (!num_scatters_.compare_exchange_weak(
+                    offset, offset + packed.numUpdates,
+                    memory_order_relaxed));
+            }
+
+            if (packed.dirty &
+                (PackDirty::transforms | PackDirty::materials)) {
+                packed.dirty |= PackDirty::transforms | PackDirty::materials;
             }
-            inst_offset += num_instances;
+        }
+
+        packed.written = packed.dirty;
+        pack_fn_(env, slot, batch_state);
+        streamFence();
+
+        state = SlotState::packed;
+    }
+
+    [[maybe_unused]] uint32_t prev_state =
+        cfg_state_->slotStates[slot].exchange(state, memory_order_release);
+    assert(prev_state == SlotState::empty ||
+           prev_state == SlotState::claimed);
+}
+
+uint32_t VulkanBackend::submitBatch()
+{
+    assert(building_);
+    building_ = false;
+
+    PerBatchState &batch_state = cfg_state_->batchStates[cur_batch_];
+
+    // Slots that were never set, including claimed ones, are inactive.
+    // Acquiring each slot's state makes its simulator thread's packing
+    // visible.
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        cfg_state_->slotStates[batch_idx].load(memory_order_acquire);
+        const Environment *env = cfg_state_->batchEnvs[batch_idx];
+
+        cfg_state_->batchScenes[batch_idx] =
+            env ? static_cast<const VulkanScene *>(env->getScene().get())
+                : nullptr;
+    }
+
+    bool copies_changed = updateActiveSlots(batch_state);
+
+    // CPU-side input setup. Also works out which slots can be skipped.
+    packInputs(batch_state);
+
+    batch_state.uploadViews = cfg_state_->instanceExtBuffer.has_value();
+    batch_state.inputsReadyValue = 0;
+
+    return finishBatch(batch_state, copies_changed);
+}
+
+uint32_t VulkanBackend::renderRaw(const RawBatch &batch)
+{
+    assert(!building_ && batch.numEnvs <= cfg_state_->batchSize);
+
+    waitForFrame(cur_batch_);
+    num_scatters_.store(0, memory_order_relaxed);
+
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        cfg_state_->batchScenes[batch_idx] =
+            batch_idx < batch.numEnvs
+                ? static_cast<const VulkanScene *>(
+                      batch.scenes[batch_idx].get())
+                : nullptr;
+    }
+
+    PerBatchState &batch_state = cfg_state_->batchStates[cur_batch_];
+    bool copies_changed = updateActiveSlots(batch_state);
+
+    packRawInputs(batch, batch_state);
+
+    bool device_inputs = cfg_state_->instanceExtBuffer.has_value();
+    batch_state.uploadViews = device_inputs && batch.views;
+    batch_state.inputsReadyValue =
+        device_inputs ? batch.inputsReadyValue : 0;
 
-            memcpy(transform_ptr, env_transforms[mesh_idx].data(),
-                   sizeof(glm::mat4x3) * num_instances);
+    return finishBatch(batch_state, copies_changed);
+}
 
-            transform_ptr += num_instances;
+// Raw environments always hold their scene's default instance layout, so
+// their draws only need repacking when the slot's scene changes or the
+// slot moves. Transforms and materials are rewritten every frame, unless
+// they were written on the device.
+void VulkanBackend::packRawInputs(const RawBatch &batch,
+                                  PerBatchState &batch_state)
+{
+    bool host_instances = batch.transforms != nullptr;
+
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        const VulkanScene *scene = cfg_state_->batchScenes[batch_idx];
+        if (!scene) {
+            prepareEnv(nullptr, batch_idx, batch_state);
+            continue;
+        }
 
-            if (material_ptr) {
-                memcpy(material_ptr, env_materials[mesh_idx].data(),
-                       num_instances * sizeof(uint32_t));
+        PackedEnvState &packed = batch_state.packedEnvs[batch_idx];
+        packed.written = 0;
+        batch_state.skippedEnvs[batch_idx] = false;
 
-                material_ptr += num_instances;
+        uint32_t dirty = 0;
+        if (host_instances) {
+            dirty |= PackDirty::transforms;
+            if (batch.materials) {
+                dirty |= PackDirty::materials;
             }
         }
 
-        if (light_ptr) {
-            uint32_t num_lights = env_backend.lights.size();
+        if (packed.envID != 0 || packed.rawSceneID != scene->sceneID) {
+            const EnvironmentInit &env_init = scene->envInit;
 
-            memcpy(light_ptr, env_backend.lights.data(),
-                   num_lights * sizeof(PackedLight));
+            uint32_t num_draws = 0;
+            for (uint32_t range_idx = 0; range_idx < env_init.ranges.size();
+                 range_idx++) {
+                num_draws +=
+                    env_init.ranges[range_idx].count *
+                    scene->meshInfo[range_idx % scene->numMeshes].numChunks;
+            }
 
-            *batch_state.numLightsPtr = num_lights;
+            packed = PackedEnvState {};
+            packed.rawSceneID = scene->sceneID;
+            packed.numInstances = env_init.transforms.size();
+            packed.numInputs = num_draws;
+            packed.numRanges = env_init.ranges.size();
+            batch_state.maxNumDraws[batch_idx] = num_draws;
 
-            light_ptr += num_lights;
+            dirty = PackDirty::all;
         }
 
-        batch_state.maxNumDraws[batch_idx] =
-            draw_id - batch_state.drawOffsets[batch_idx];
+        packed.dirty = dirty;
     }
 
-    uint32_t total_draws = draw_id;
+    layoutInputs(batch_state);
 
-    assert(total_draws < VulkanConfig::max_instances);
+    // Device inputs are already in place, even if the slots moved
+    if (!host_instances) {
+        batch_state.instanceUploads.clear();
+    }
 
-    VkRenderPassBeginInfo render_pass_info;
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    render_pass_info.pNext = nullptr;
-    render_pass_info.renderPass = render_state_.renderPass;
-    render_pass_info.framebuffer = fb_.hdl;
-    render_pass_info.clearValueCount =
-        static_cast<uint32_t>(fb_cfg_.clearValues.size());
-    render_pass_info.pClearValues = fb_cfg_.clearValues.data();
+    // When each env's instances directly follow the previous env's, the
+    // caller's arrays match the param buffer's layout
+    bool contiguous = host_instances;
+    for (uint32_t batch_idx = 0; contiguous && batch_idx < batch.numEnvs;
+         batch_idx++) {
+        if (batch.instanceOffsets[batch_idx] - batch.instanceOffsets[0] !=
+            batch_state.instanceOffsets[batch_idx]) {
+            contiguous = false;
+        }
+    }
 
-    // 1 indirect draw per batch elem
-    uint32_t global_batch_offset = 0;
-    for (int mini_batch_idx = 0; mini_batch_idx < (int)num_mini_batches_;
-         mini_batch_idx++) {
-        // Record culling for this mini batch
-        for (int local_batch_idx = 0; local_batch_idx < (int)mini_batch_size_;
-             local_batch_idx++) {
-            uint32_t batch_idx = global_batch_offset + local_batch_idx;
-            const Environment &env = envs[batch_idx];
-            const VulkanEnvironment &env_backend =
-                *static_cast<const VulkanEnvironment *>(env.getBackend());
-            const VulkanScene &scene =
-                *static_cast<const VulkanScene *>(env.getScene().get());
-
-            dev.dt.cmdBindDescriptorSets(render_cmd,
-                                         VK_PIPELINE_BIND_POINT_COMPUTE,
-                                         pipeline_.rasterState.cullLayout, 1,
-                                         1, &scene.cullSet.hdl, 0, nullptr);
-
-            CullPushConstant cull_const {env_backend.frustumBounds, batch_idx,
-                                         batch_state.drawOffsets[batch_idx],
-                                         batch_state.maxNumDraws[batch_idx]};
-
-            dev.dt.cmdPushConstants(render_cmd,
-                                    pipeline_.rasterState.cullLayout,
-                                    VK_SHADER_STAGE_COMPUTE_BIT, 0,
-                                    sizeof(CullPushConstant), &cull_const);
-
-            dev.dt.cmdDispatch(
-                render_cmd,
-                getWorkgroupSize(batch_state.maxNumDraws[batch_idx]), 1, 1);
+    uint32_t num_tasks =
+        (batch.numEnvs + VulkanConfig::pack_envs_per_task - 1) /
+        VulkanConfig::pack_envs_per_task;
+
+    pack_workers_.run(num_tasks, [&](uint32_t task_idx) {
+        uint32_t begin = task_idx * VulkanConfig::pack_envs_per_task;
+        uint32_t end =
+            min(begin + VulkanConfig::pack_envs_per_task, batch.numEnvs);
+
+        for (uint32_t batch_idx = begin; batch_idx < end; batch_idx++) {
+            const VulkanScene &scene = *cfg_state_->batchScenes[batch_idx];
+            PackedEnvState &packed = batch_state.packedEnvs[batch_idx];
+
+            if (batch.views) {
+                ViewInfo view_info;
+                view_info.projection = batch.projections[batch_idx];
+                view_info.view = batch.views[batch_idx];
+                streamCopy(&batch_state.viewPtr[batch_idx], &view_info,
+                           sizeof(ViewInfo));
+            }
+
+            CullEnvParams cull_params {
+                computeFrustumBounds(batch.projections[batch_idx]),
+                batch_state.maxNumDraws[batch_idx],
+                batch_state.inputOffsets[batch_idx],
+                0,
+            };
+            streamCopy(&batch_state.cullParamsPtr[batch_idx], &cull_params,
+                       sizeof(CullEnvParams));
+
+            uint32_t dirty = packed.dirty;
+            if (!need_materials_) {
+                dirty &= ~PackDirty::materials;
+            }
+            if (!host_instances) {
+                dirty &= ~(PackDirty::transforms | PackDirty::materials);
+            }
+
+            uint32_t inst_offset = batch_state.instanceOffsets[batch_idx];
+
+            if (dirty & PackDirty::draws) {
+                const auto &ranges = scene.envInit.ranges;
+                uint32_t draw_id = batch_state.inputOffsets[batch_idx];
+                DrawRange *range_ptr = batch_state.drawRangePtr +
+                                       batch_state.rangeOffsets[batch_idx];
+
+                for (uint32_t range_idx = 0; range_idx < ranges.size();
+                     range_idx++) {
+                    const InstanceRange &range = ranges[range_idx];
+                    const MeshInfo &mesh_metadata =
+                        scene.meshInfo[range_idx % scene.numMeshes];
+
+                    DrawRange draw_range {
+                        draw_id,
+                        inst_offset + range.offset,
+                        range.count,
+                        mesh_metadata.chunkOffset,
+                        mesh_metadata.numChunks,
+                    };
+                    streamCopy(range_ptr++, &draw_range, sizeof(DrawRange));
+
+                    draw_id += range.count * mesh_metadata.numChunks;
+                }
+            }
+
+            uint32_t src_offset = batch.instanceOffsets[batch_idx];
+
+            if (!contiguous && (dirty & PackDirty::transforms)) {
+                streamCopy(batch_state.transformPtr + inst_offset,
+                           batch.transforms + src_offset,
+                           sizeof(glm::mat4x3) * packed.numInstances);
+            }
+
+            // Without caller materials the scene's defaults only need
+            // writing when the slot's instances moved
+            if (dirty & PackDirty::materials) {
+                if (!batch.materials) {
+                    streamCopy(batch_state.materialPtr + inst_offset,
+                               scene.envInit.materials.data(),
+                               sizeof(uint32_t) * packed.numInstances);
+                } else if (!contiguous) {
+                    streamCopy(batch_state.materialPtr + inst_offset,
+                               batch.materials + src_offset,
+                               sizeof(uint32_t) * packed.numInstances);
+                }
+            }
+
+            packed.dirty = 0;
         }
 
-        // Cull / render barrier
-        VkBufferMemoryBarrier buffer_barrier;
-        buffer_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-        buffer_barrier.pNext = nullptr;
-        buffer_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-        buffer_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
-        buffer_barrier.srcQueueFamilyIndex = 0;
-        buffer_barrier.dstQueueFamilyIndex = 0;
-        buffer_barrier.buffer = indirect_draw_buffer_.buffer;
-        buffer_barrier.offset = 0;
-        buffer_barrier.size = VK_WHOLE_SIZE;
-
-        dev.dt.cmdPipelineBarrier(render_cmd,
-                                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                                  VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 0,
-                                  nullptr, 1, &buffer_barrier, 0, nullptr);
-
-        // Record rendering for this mini batch
-        glm::u32vec2 minibatch_offset =
-            batch_state.batchFBOffsets[global_batch_offset];
-        render_pass_info.renderArea.offset = {
-            static_cast<int32_t>(minibatch_offset.x),
-            static_cast<int32_t>(minibatch_offset.y),
-        };
-        render_pass_info.renderArea.extent = {
-            per_minibatch_render_size_.x,
-            per_minibatch_render_size_.y,
-        };
+        // Contiguous batches are copied as one span per task
+        if (contiguous && begin < end) {
+            uint32_t first_inst = batch_state.instanceOffsets[begin];
+            uint32_t num_insts = batch_state.instanceOffsets[end - 1] +
+                                 batch_state.packedEnvs[end - 1].numInstances -
+                                 first_inst;
+            uint32_t src_offset = batch.instanceOffsets[0] + first_inst;
+
+            streamCopy(batch_state.transformPtr + first_inst,
+                       batch.transforms + src_offset,
+                       sizeof(glm::mat4x3) * num_insts);
+
+            if (need_materials_ && batch.materials) {
+                streamCopy(batch_state.materialPtr + first_inst,
+                           batch.materials + src_offset,
+                           sizeof(uint32_t) * num_insts);
+            }
+        }
 
-        dev.dt.cmdBeginRenderPass(render_cmd, &render_pass_info,
-                                  VK_SUBPASS_CONTENTS_INLINE);
+        streamFence();
+    });
+}
 
-        for (uint32_t local_batch_idx = 0; local_batch_idx < mini_batch_size_;
-             local_batch_idx++) {
-            uint32_t batch_idx = global_batch_offset + local_batch_idx;
-            const Environment &env = envs[batch_idx];
-            const VulkanScene &scene =
-                *static_cast<const VulkanScene *>(env.getScene().get());
+bool VulkanBackend::updateActiveSlots(PerBatchState &batch_state)
+{
+    bool copies_changed = false;
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        bool env_active = cfg_state_->batchScenes[batch_idx] != nullptr;
 
-            dev.dt.cmdBindDescriptorSets(
-                render_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                pipeline_.rasterState.drawLayout, 1, 1, &scene.drawSet.hdl,
-                0, nullptr);
+        batch_state.activeEnvs[batch_idx] = env_active;
 
-            glm::u32vec2 batch_offset = batch_state.batchFBOffsets[batch_idx];
+        // A kept output becomes one that may need zeroing
+        if (!env_active && batch_state.skippedEnvs[batch_idx]) {
+            copies_changed = true;
+        }
+    }
 
-            DrawPushConstant draw_const {
-                batch_idx,
-            };
+    return copies_changed;
+}
 
-            dev.dt.cmdPushConstants(
-                render_cmd, pipeline_.rasterState.drawLayout,
-                VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
-                sizeof(DrawPushConstant), &draw_const);
-
-            VkViewport viewport;
-            viewport.x = batch_offset.x;
-            viewport.y = batch_offset.y;
-            viewport.width = per_elem_render_size_.x;
-            viewport.height = per_elem_render_size_.y;
-            viewport.minDepth = 0.f;
-            viewport.maxDepth = 1.f;
-            dev.dt.cmdSetViewport(render_cmd, 0, 1, &viewport);
-
-            dev.dt.cmdBindIndexBuffer(render_cmd, scene.data.buffer,
-                                      scene.indexOffset, VK_INDEX_TYPE_UINT32);
-
-            VkDeviceSize indirect_offset =
-                batch_state.indirectBaseOffset +
-                batch_state.drawOffsets[batch_idx] *
-                    sizeof(VkDrawIndexedIndirectCommand);
-
-            VkDeviceSize count_offset = batch_state.indirectCountBaseOffset +
-                                        batch_idx * sizeof(uint32_t);
-
-            dev.dt.cmdDrawIndexedIndirectCountKHR(
-                render_cmd, indirect_draw_buffer_.buffer, indirect_offset,
-                indirect_draw_buffer_.buffer, count_offset,
-                batch_state.maxNumDraws[batch_idx],
-                sizeof(VkDrawIndexedIndirectCommand));
+uint32_t VulkanBackend::finishBatch(PerBatchState &batch_state,
+                                    bool copies_changed)
+{
+    uint32_t num_skipped = 0;
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        bool skipped = batch_state.skippedEnvs[batch_idx];
+        bool copied = batch_state.activeEnvs[batch_idx] && !skipped;
+
+        if (batch_state.copiedEnvs[batch_idx] != copied) {
+            batch_state.copiedEnvs[batch_idx] = copied;
+            copies_changed = true;
         }
-        dev.dt.cmdEndRenderPass(render_cmd);
 
-        global_batch_offset += mini_batch_size_;
+        num_skipped += skipped;
+    }
+    batch_state.numSkipped = num_skipped;
+
+    // The output copies are prerecorded, and only need rerecording when
+    // the set of copied slots changes
+    if (copies_changed) {
+        recordFBToLinearCopy(dev, cfg_state_->backendCfg, batch_state,
+                             cfg_state_->fbCfg, cfg_state_->fb);
+    }
+
+    // Recorded render commands only depend on which scene each slot draws
+    // and where its output draws live. Everything else is read from the
+    // param buffer.
+    // Padded draw capacities can overflow the indirect draw buffer even
+    // when the exact draw counts fit, in which case the exact counts are
+    // used instead
+    uint64_t padded_draws = 0;
+    uint64_t exact_draws = 0;
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        if (batch_state.activeEnvs[batch_idx]) {
+            uint32_t num_draws = batch_state.maxNumDraws[batch_idx];
+            padded_draws += drawCapacity(num_draws);
+            exact_draws += num_draws;
+        }
+    }
+
+    if (exact_draws > VulkanConfig::max_instances) {
+        cerr << "Vulkan: Batch needs " << exact_draws << " draws, only "
+             << VulkanConfig::max_instances << " are supported" << endl;
+        fatalExit();
+    }
+    bool pad_draws = padded_draws <= VulkanConfig::max_instances;
+
+    bool render_changed = !batch_state.renderRecorded;
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->batchSize;
+         batch_idx++) {
+        RecordedSlot slot {};
+        if (batch_state.activeEnvs[batch_idx]) {
+            uint32_t num_draws = batch_state.maxNumDraws[batch_idx];
+            slot.sceneID = cfg_state_->batchScenes[batch_idx]->sceneID;
+            slot.drawCapacity =
+                pad_draws ? drawCapacity(num_draws) : num_draws;
+        }
+
+        RecordedSlot &recorded = batch_state.recordedSlots[batch_idx];
+        if (recorded.sceneID != slot.sceneID ||
+            recorded.drawCapacity != slot.drawCapacity) {
+            recorded = slot;
+            render_changed = true;
+        }
+    }
+
+    if (render_changed) {
+        recordRenderSlices(batch_state);
+        batch_state.renderRecorded = true;
+    }
+
+    if (render_changed || copies_changed) {
+        recordBatchCommands(batch_state);
+    }
+
+    // Uploads are only submitted on frames that have any
+    uint32_t first_cmd = 1;
+    if (batch_state.expandDraws || batch_state.uploadViews ||
+        (cfg_state_->instanceBuffer.has_value() &&
+         (!batch_state.instanceUploads.empty() ||
+          batch_state.numInstanceScatters > 0))) {
+        VkCommandBuffer upload_cmd = batch_state.commands[0];
+
+        VkCommandBufferBeginInfo begin_info {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        REQ_VK(dev.dt.beginCommandBuffer(upload_cmd, &begin_info));
+        if (batch_state.expandDraws) {
+            recordDrawExpansion(upload_cmd, batch_state);
+        }
+        recordInstanceUploads(upload_cmd, batch_state);
+        REQ_VK(dev.dt.endCommandBuffer(upload_cmd));
+
+        first_cmd = 0;
     }
-    REQ_VK(dev.dt.endCommandBuffer(render_cmd));
 
-    render_input_buffer_.flush(dev);
+    cfg_state_->renderInputBuffer.flush(dev);
 
     uint32_t rendered_batch_idx = cur_batch_;
 
-    VkSubmitInfo gfx_submit {VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                             nullptr,
-                             0,
-                             nullptr,
-                             nullptr,
-                             uint32_t(batch_state.commands.size()),
-                             batch_state.commands.data(),
-                             0,
-                             nullptr};
+    uint32_t queue_idx = getRenderQueueIdx(cur_batch_);
+    VkSemaphore frame_timeline = frame_timelines_[queue_idx];
+
+    unique_lock<mutex> notifier_guard(notifier_lock_);
+    batch_state.timelineValue = ++last_timeline_value_;
+
+    VkTimelineSemaphoreSubmitInfoKHR timeline_submit {
+        VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+        nullptr,
+        0,
+        nullptr,
+        1,
+        &batch_state.timelineValue,
+    };
 
-    graphics_queues_[0].submit(dev, 1, &gfx_submit, batch_state.fence);
+    // Inputs written on the device may be read by the first command
+    // buffer's uploads and expansion as well as by culling
+    bool wait_inputs = batch_state.inputsReadyValue > 0;
+    VkTimelineSemaphoreSubmitInfoKHR input_wait_submit {
+        VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+        nullptr,
+        1,
+        &batch_state.inputsReadyValue,
+        0,
+        nullptr,
+    };
+    VkPipelineStageFlags input_wait_stage =
+        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+    VkSubmitInfo cull_submit {VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                              wait_inputs ? &input_wait_submit : nullptr,
+                              wait_inputs ? 1u : 0u,
+                              &input_semaphore_,
+                              &input_wait_stage,
+                              2 - first_cmd,
+                              batch_state.commands.data() + first_cmd,
+                              1,
+                              &batch_state.cullSemaphore};
+
+    const QueueState &render_queue = graphics_queues_[queue_idx];
+    const QueueState &cull_queue = cfg_state_->backendCfg.asyncCompute
+                                       ? compute_queues_[0]
+                                       : render_queue;
+    cull_queue.submit(dev, 1, &cull_submit, VK_NULL_HANDLE);
+
+    VkPipelineStageFlags cull_wait_stage =
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
 
-    cur_batch_ = (cur_batch_ + 1) & batch_mask_;
+    VkSubmitInfo gfx_submit {VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                             &timeline_submit,
+                             1,
+                             &batch_state.cullSemaphore,
+                             &cull_wait_stage,
+                             1,
+                             &batch_state.commands[2],
+                             1,
+                             &frame_timeline};
+
+    render_queue.submit(dev, 1, &gfx_submit, VK_NULL_HANDLE);
+    cfg_state_->completionNotifier.push(SubmittedFrame {
+        cur_batch_,
+        frame_timeline,
+        batch_state.timelineValue,
+    });
+    notifier_guard.unlock();
+
+    cur_batch_ = (cur_batch_ + 1) % cfg_state_->numBatches;
 
     return rendered_batch_idx;
 }
 
 void VulkanBackend::waitForFrame(uint32_t batch_idx)
 {
-    VkFence fence = batch_states_[batch_idx].fence;
-    assert(fence != VK_NULL_HANDLE);
-    waitForFenceInfinitely(dev, fence);
-    resetFence(dev, fence);
+    // Waiting on a batch that already finished, or was never submitted,
+    // returns immediately
+    waitForTimelineInfinitely(
+        dev, frame_timelines_[getRenderQueueIdx(batch_idx)],
+        cfg_state_->batchStates[batch_idx].timelineValue);
+}
+
+bool VulkanBackend::isFrameReady(uint32_t batch_idx)
+{
+    uint64_t completed_value;
+    REQ_VK(dev.dt.getSemaphoreCounterValueKHR(
+        dev.hdl, frame_timelines_[getRenderQueueIdx(batch_idx)],
+        &completed_value));
+
+    return completed_value >= cfg_state_->batchStates[batch_idx].timelineValue;
+}
+
+int VulkanBackend::getFrameReadyFD(uint32_t batch_idx)
+{
+    startCompletionNotifier();
+
+    return cfg_state_->completionNotifier.getReadyFD(batch_idx);
+}
+
+void VulkanBackend::setFrameCallback(function<void(uint32_t)> &&cb)
+{
+    cfg_state_->completionNotifier.setCallback(move(cb));
+
+    startCompletionNotifier();
+}
+
+// Starts the notifier if it isn't running yet. Safe to call from any
+// thread, concurrently with render.
+void VulkanBackend::startCompletionNotifier()
+{
+    lock_guard<mutex> guard(notifier_lock_);
+    if (cfg_state_->completionNotifier.isRunning()) {
+        return;
+    }
+
+    // Batches already in flight still get notified
+    vector<SubmittedFrame> in_flight;
+    for (uint32_t batch_idx = 0; batch_idx < cfg_state_->numBatches;
+         batch_idx++) {
+        if (!isFrameReady(batch_idx)) {
+            in_flight.push_back(SubmittedFrame {
+                batch_idx,
+                frame_timelines_[getRenderQueueIdx(batch_idx)],
+                cfg_state_->batchStates[batch_idx].timelineValue,
+            });
+        }
+    }
+
+    // Timeline values are shared between queues, so they give the order
+    // batches were submitted in
+    sort(in_flight.begin(), in_flight.end(),
+         [](auto &a, auto &b) { return a.value < b.value; });
+
+    cfg_state_->completionNotifier.start(in_flight);
 }
 
 uint8_t *VulkanBackend::getColorPointer(uint32_t batch_idx)
 {
-    return (uint8_t *)fb_.extBuffer.getDevicePointer() +
-           batch_states_[batch_idx].colorBufferOffset;
+    return (uint8_t *)cfg_state_->fb.extBuffer.getDevicePointer() +
+           cfg_state_->batchStates[batch_idx].colorBufferOffset;
 }
 
 float *VulkanBackend::getDepthPointer(uint32_t batch_idx)
 {
-    return (float *)((uint8_t *)fb_.extBuffer.getDevicePointer() +
-                     batch_states_[batch_idx].depthBufferOffset);
+    return (float *)((uint8_t *)cfg_state_->fb.extBuffer.getDevicePointer() +
+                     cfg_state_->batchStates[batch_idx].depthBufferOffset);
+}
+
+uint32_t VulkanBackend::getNumSkipped(uint32_t batch_idx)
+{
+    return cfg_state_->batchStates[batch_idx].numSkipped;
+}
+
+DeviceInputs VulkanBackend::getDeviceInputs(uint32_t batch_idx)
+{
+    assert(cfg_state_->instanceExtBuffer.has_value());
+
+    const ParamBufferConfig &param_cfg = cfg_state_->paramCfg;
+
+    uint8_t *base_ptr =
+        (uint8_t *)cfg_state_->instanceExtBuffer->getDevicePointer() +
+        cfg_state_->batchStates[batch_idx].instanceBaseOffset;
+
+    return DeviceInputs {
+        (glm::mat4x3 *)base_ptr,
+        need_materials_
+            ? (uint32_t *)(base_ptr + param_cfg.materialIndicesOffset)
+            : nullptr,
+        (glm::mat4 *)(base_ptr + param_cfg.viewOffset),
+    };
+}
+
+int VulkanBackend::getInputSemaphoreFD()
+{
+    assert(input_semaphore_ != VK_NULL_HANDLE);
+
+    return exportSemaphore(dev, input_semaphore_);
 }
 
 }
@@ -3,16 +3,19 @@
 #include <array>
 #include <atomic>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <vector>
 
 #include <bps3D/config.hpp>
 #include <bps3D_core/common.hpp>
+#include <bps3D_core/worker_pool.hpp>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/type_precision.hpp>
 
+#include "completion.hpp"
 #include "core.hpp"
 #include "cuda_interop.hpp"
 #include "descriptors.hpp"
@@ -22,12 +25,25 @@
 namespace bps3D {
 namespace vk {
 
+struct VulkanScene;
+
 struct BackendConfig {
     bool colorOutput;
     bool depthOutput;
     bool needMaterials;
     bool needLighting;
     uint32_t numBatches;
+    bool deviceLocalInstances;
+    bool zeroInactiveOutputs;
+    bool asyncCompute;
+    bool multiQueue;
+    bool deviceInputs;
+};
+
+// Attachment limits of the device, capped by VulkanConfig
+struct FramebufferLimits {
+    uint32_t maxDimension;
+    uint32_t maxLayers;
 };
 
 struct FramebufferConfig {
@@ -35,16 +51,17 @@ struct FramebufferConfig {
     uint32_t imgHeight;
 
     uint32_t miniBatchSize;
-    uint32_t numImagesWidePerMiniBatch;
-    uint32_t numImagesTallPerMiniBatch;
 
-    uint32_t numImagesWidePerBatch;
-    uint32_t numImagesTallPerBatch;
+    // Each mini batch renders into its own array layers of the
+    // attachments, each layer holding a grid of images
+    uint32_t numImagesWidePerLayer;
+    uint32_t numImagesTallPerLayer;
+    uint32_t numLayersPerMiniBatch;
+    uint32_t numLayersPerBatch;
 
-    uint32_t frameWidth;
-    uint32_t frameHeight;
-    uint32_t totalWidth;
-    uint32_t totalHeight;
+    uint32_t layerWidth;
+    uint32_t layerHeight;
+    uint32_t totalLayers;
 
     uint64_t colorLinearBytesPerBatch;
     uint64_t depthLinearBytesPerBatch;
@@ -64,11 +81,25 @@ struct ParamBufferConfig {
     VkDeviceSize materialIndicesOffset;
     VkDeviceSize totalMaterialIndexBytes;
 
+    // Transforms and material indices are mirrored at the same offsets
+    // in the device-local instance buffer, when one is in use. With device
+    // inputs the ViewInfos are too.
+    VkDeviceSize totalInstanceBytes;
+
     VkDeviceSize lightsOffset;
     VkDeviceSize totalLightParamBytes;
 
-    VkDeviceSize cullInputOffset;
-    VkDeviceSize totalCullInputBytes;
+    VkDeviceSize drawRangeOffset;
+    VkDeviceSize totalDrawRangeBytes;
+
+    VkDeviceSize cullParamsOffset;
+    VkDeviceSize totalCullParamBytes;
+
+    VkDeviceSize cullDispatchOffset;
+    VkDeviceSize totalCullDispatchBytes;
+
+    VkDeviceSize scatterInputOffset;
+    VkDeviceSize totalScatterInputBytes;
 
     VkDeviceSize totalParamBytes;
 
@@ -78,6 +109,10 @@ struct ParamBufferConfig {
     VkDeviceSize drawIndirectOffset;
     VkDeviceSize totalDrawIndirectBytes;
 
+    // Cull inputs, expanded from the draw ranges on the GPU
+    VkDeviceSize drawInputOffset;
+    VkDeviceSize totalDrawInputBytes;
+
     VkDeviceSize totalIndirectBytes;
 };
 
@@ -85,7 +120,8 @@ struct FramebufferState {
     std::vector<LocalImage> attachments;
     std::vector<VkImageView> attachmentViews;
 
-    VkFramebuffer hdl;
+    // One per mini batch, over that mini batch's layers
+    std::vector<VkFramebuffer> hdls;
 
     LocalBuffer resultBuffer;
     VkDeviceMemory resultMem;
@@ -98,10 +134,9 @@ struct RenderState {
     VkRenderPass renderPass;
 
     ShaderPipeline cull;
-    FixedDescriptorPool cullPool;
-
     ShaderPipeline draw;
-    FixedDescriptorPool drawPool;
+    ShaderPipeline scatter;
+    ShaderPipeline expand;
 };
 
 struct RasterPipelineState {
@@ -110,6 +145,12 @@ struct RasterPipelineState {
 
     VkPipelineLayout drawLayout;
     VkPipeline drawPipeline;
+
+    VkPipelineLayout scatterLayout;
+    VkPipeline scatterPipeline;
+
+    VkPipelineLayout expandLayout;
+    VkPipeline expandPipeline;
 };
 
 struct PipelineState {
@@ -119,19 +160,108 @@ struct PipelineState {
     RasterPipelineState rasterState;
 };
 
+// Categories of per-environment data that must be rewritten into the
+// param buffer this frame. The ViewInfo is always rewritten.
+namespace PackDirty {
+constexpr uint32_t draws = 1 << 0;
+constexpr uint32_t transforms = 1 << 1;
+constexpr uint32_t materials = 1 << 2;
+constexpr uint32_t lights = 1 << 3;
+constexpr uint32_t all = draws | transforms | materials | lights;
+// Only the instances in the env's update log changed
+constexpr uint32_t instances = 1 << 4;
+}
+
+// Progress of each slot of the batch being built
+namespace SlotState {
+constexpr uint32_t empty = 0;
+constexpr uint32_t claimed = 1;
+// Environment set, and its changes worked out, but not yet packed
+constexpr uint32_t prepared = 2;
+// Environment set and packed at the slot's offsets from the last frame
+constexpr uint32_t packed = 3;
+}
+
+// What a batch's cached render commands were recorded for, per slot
+struct RecordedSlot {
+    // 0 for inactive slots
+    uint64_t sceneID;
+    uint32_t drawCapacity;
+};
+
+// What was last packed into one batch slot of the param buffer
+struct PackedEnvState {
+    // 0 for slots packed by renderRaw, which only track their scene
+    uint64_t envID;
+    uint64_t rawSceneID;
+    EnvironmentVersion version;
+    uint32_t numInstances;
+    uint32_t numInputs;
+    uint32_t numRanges;
+    uint32_t numStaticDraws;
+    uint32_t numLights;
+    uint32_t dirty;
+    // Categories already packed this frame by the slot's simulator thread
+    uint32_t written;
+    uint32_t numUpdates;
+    uint32_t scatterOffset;
+};
+
 struct PerBatchState {
-    VkFence fence;
-    std::array<VkCommandBuffer, 2> commands;
-    // indirectDrawBuffer starts with batch_size draw counts,
-    // followed by the actual indirect draw commands
+    // Value of the frame timeline of the batch's render queue once its
+    // latest submission completes
+    uint64_t timelineValue;
+    // Instance uploads (recorded per frame) and culling, submitted to the
+    // cull queue, then rendering (including output copies) on the graphics
+    // queue
+    std::array<VkCommandBuffer, 3> commands;
+    // Signaled by culling, waited on by rendering
+    VkSemaphore cullSemaphore;
+    // indirectDrawBuffer starts with batch_size draw counts, one per run
+    // of same-scene slots at the run's first record order index, followed
+    // by the actual indirect draw commands
     VkDeviceSize indirectCountBaseOffset;
     VkDeviceSize indirectCountTotalBytes;
     VkDeviceSize indirectBaseOffset;
+    // Laid out in record order when render commands are recorded
     DynArray<uint32_t> drawOffsets;
     DynArray<uint32_t> maxNumDraws;
-
-    glm::u32vec2 baseFBOffset;
+    // Offsets of each env's own DrawInputs, which exclude static draws,
+    // and of the DrawRanges they are expanded from
+    DynArray<uint32_t> inputOffsets;
+    DynArray<uint32_t> rangeOffsets;
+    DynArray<uint32_t> instanceOffsets;
+    DynArray<uint32_t> lightOffsets;
+    DynArray<PackedEnvState> packedEnvs;
+    // Slots rendered this frame, and the slots copyCommands copy out
+    DynArray<bool> activeEnvs;
+    DynArray<bool> copiedEnvs;
+    // Active slots unchanged since this batch last rendered them. They
+    // aren't culled, drawn or copied, so their output is left in place.
+    DynArray<bool> skippedEnvs;
+    uint32_t numSkipped;
+    // Render commands are only rerecorded when these change
+    DynArray<RecordedSlot> recordedSlots;
+    // Order slots are recorded in, grouped by scene within each mini batch
+    // so scene bindings are shared by consecutive slots. Outputs stay at
+    // each slot's own atlas position, so callers see no reordering.
+    DynArray<uint32_t> recordOrder;
+    bool renderRecorded;
+    // Secondary cull and draw commands for each slice of a mini batch,
+    // recorded in parallel. Each slice has its own pools, so no pool is
+    // ever used from two threads at once.
+    DynArray<VkCommandPool> cullPools;
+    DynArray<VkCommandPool> drawPools;
+    DynArray<VkCommandBuffer> cullCommands;
+    DynArray<VkCommandBuffer> drawCommands;
+    // Secondary output copies for each mini batch
+    DynArray<VkCommandBuffer> copyCommands;
+
+    // Framebuffer of each mini batch, and each slot's position within
+    // its layer and attachment layer
+    DynArray<VkFramebuffer> framebuffers;
     DynArray<glm::u32vec2> batchFBOffsets;
+    DynArray<uint32_t> batchFBLayers;
 
     VkDeviceSize colorBufferOffset;
     VkDeviceSize depthBufferOffset;
@@ -144,63 +274,198 @@ struct PerBatchState {
     uint32_t *materialPtr;
     PackedLight *lightPtr;
     uint32_t *numLightsPtr;
-    DrawInput *drawPtr;
+    DrawRange *drawRangePtr;
+    CullEnvParams *cullParamsPtr;
+    // Written when render commands are recorded, indexed by record order
+    CullDispatchEnv *cullDispatchPtr;
+
+    // The draw ranges of the whole batch are expanded into cull inputs on
+    // frames where any slot's draws were repacked
+    VkDescriptorSet expandSet;
+    uint32_t numDrawRanges;
+    uint32_t numDrawInputs;
+    bool expandDraws;
+
+    // Device-local instance data only. Whole environments are copied from
+    // the host-side transforms / materials; partial updates are scattered.
+    VkDeviceSize paramBaseOffset;
+    VkDeviceSize instanceBaseOffset;
+    VkDescriptorSet scatterSet;
+    InstanceScatter *scatterPtr;
+    std::vector<std::pair<uint32_t, uint32_t>> instanceUploads;
+    uint32_t numInstanceScatters;
+
+    // Device inputs only. ViewInfos packed on the host are copied over
+    // unless the frame's cameras were written on the device, and the
+    // frame's inputs aren't read before the input semaphore reaches
+    // inputsReadyValue.
+    bool uploadViews;
+    uint64_t inputsReadyValue;
+};
+
+// Writes the render inputs of env into its slot of the batch's param
+// buffer, with non-temporal stores that need a streamFence before the
+// batch is submitted. Offsets must already be computed. Specialized per
+// BackendConfig.
+using PackEnvFn = void (*)(const Environment &env,
+                           uint32_t batch_idx,
+                           PerBatchState &batch_state);
+
+// Everything sized by the RenderConfig. reconfigure builds a new one
+// before dropping the old, rather than rebuilding it in place.
+struct ConfigState {
+    ConfigState(const DeviceState &dev,
+                MemoryAllocator &alloc,
+                const RenderConfig &cfg,
+                const BackendConfig &backend_cfg,
+                const FramebufferLimits &fb_limits,
+                const RenderState &render_state);
+    ConfigState(const ConfigState &) = delete;
+    ~ConfigState();
+
+    const DeviceState &dev;
+
+    uint32_t batchSize;
+    BackendConfig backendCfg;
+    FramebufferConfig fbCfg;
+    ParamBufferConfig paramCfg;
+    uint32_t numBatches;
+    // Batches are assigned round robin to the render queues
+    uint32_t numRenderQueues;
+    uint32_t miniBatchSize;
+    uint32_t numMiniBatches;
+    uint32_t slicesPerMiniBatch;
+    glm::u32vec2 perMinibatchRenderSize;
+
+    FixedDescriptorPool cullPool;
+    FixedDescriptorPool drawPool;
+    FixedDescriptorPool scatterPool;
+    FixedDescriptorPool expandPool;
+
+    PipelineState pipeline;
+    FramebufferState fb;
+
+    HostBuffer renderInputBuffer;
+    LocalBuffer indirectDrawBuffer;
+    std::optional<LocalBuffer> instanceBuffer;
+    // With device inputs the instance buffer is exported to CUDA, and
+    // its producer signals the input semaphore once a batch's are written
+    std::optional<CudaImportedBuffer> instanceExtBuffer;
+
+    VkCommandPool gfxCmdPool;
+    VkCommandPool cullCmdPool;
+
+    std::vector<PerBatchState> batchStates;
+
+    // The batch being built. Simulator threads claim and set its slots
+    // concurrently, so slot states are only updated atomically.
+    DynArray<const Environment *> batchEnvs;
+    // Scene of each active slot, however the batch was built
+    DynArray<const VulkanScene *> batchScenes;
+    DynArray<std::atomic_uint32_t> slotStates;
+
+    FrameCompletionNotifier completionNotifier;
 };
 
 class VulkanBackend : public RenderBackend {
 public:
     VulkanBackend(const RenderConfig &cfg, bool validate);
+    ~VulkanBackend();
     LoaderImpl makeLoader();
 
     EnvironmentImpl makeEnvironment(const Camera &cam,
                                     const std::shared_ptr<Scene> &scene);
 
-    uint32_t render(const Environment *envs);
+    uint32_t render(const Environment *envs,
+                    uint32_t num_envs,
+                    const bool *active);
+    uint32_t renderRaw(const RawBatch &batch);
+
+    void beginBatch();
+    uint32_t claimSlot();
+    void setEnvironment(uint32_t slot, const Environment &env);
+    uint32_t submitBatch();
 
     void waitForFrame(uint32_t batch_idx);
+    bool isFrameReady(uint32_t batch_idx);
+    int getFrameReadyFD(uint32_t batch_idx);
+    void setFrameCallback(std::function<void(uint32_t)> &&cb);
 
     uint8_t *getColorPointer(uint32_t batch_idx);
     float *getDepthPointer(uint32_t batch_idx);
 
+    uint32_t getNumSkipped(uint32_t batch_idx);
+
+    DeviceInputs getDeviceInputs(uint32_t batch_idx);
+    int getInputSemaphoreFD();
+
+    void reconfigure(const RenderConfig &cfg);
+
 private:
     VulkanBackend(const RenderConfig &cfg,
                   const BackendConfig &backend_cfg,
                   bool validate);
 
-    const uint32_t batch_size_;
+    void prepareEnv(const Environment *env,
+                    uint32_t batch_idx,
+                    PerBatchState &batch_state);
+    void packInputs(PerBatchState &batch_state);
+    void layoutInputs(PerBatchState &batch_state);
+    void packRawInputs(const RawBatch &batch, PerBatchState &batch_state);
+    bool updateActiveSlots(PerBatchState &batch_state);
+    uint32_t finishBatch(PerBatchState &batch_state, bool copies_changed);
+    void recordDrawExpansion(VkCommandBuffer cmd,
+                             const PerBatchState &batch_state);
+    void recordInstanceUploads(VkCommandBuffer cmd,
+                               const PerBatchState &batch_state);
+    void startCompletionNotifier();
+    void scheduleRecordOrder(PerBatchState &batch_state);
+    void recordRenderSlices(PerBatchState &batch_state);
+    void recordRenderSlice(const PerBatchState &batch_state,
+                           uint32_t slice_idx);
+    void recordBatchCommands(PerBatchState &batch_state);
+    uint32_t getRenderQueueIdx(uint32_t batch_idx) const;
 
     const InstanceState inst;
     const DeviceState dev;
 
     MemoryAllocator alloc;
 
-    const FramebufferConfig fb_cfg_;
-    const ParamBufferConfig param_cfg_;
+    const FramebufferLimits fb_limits_;
     RenderState render_state_;
-    PipelineState pipeline_;
-    FramebufferState fb_;
 
     DynArray<QueueState> transfer_queues_;
     DynArray<QueueState> graphics_queues_;
     DynArray<QueueState> compute_queues_;
 
-    HostBuffer render_input_buffer_;
-    LocalBuffer indirect_draw_buffer_;
+    VkSemaphore input_semaphore_;
 
-    VkCommandPool gfx_cmd_pool_;
     std::atomic_int num_loaders_;
     int max_loaders_;
+    int gpu_id_;
     bool need_materials_;
     bool need_lighting_;
-    const uint32_t mini_batch_size_;
-    const uint32_t num_mini_batches_;
-    glm::u32vec2 per_elem_render_size_;
-    glm::u32vec2 per_minibatch_render_size_;
 
-    std::vector<PerBatchState> batch_states_;
+    WorkerPool pack_workers_;
+    const PackEnvFn pack_fn_;
+
+    std::atomic_uint32_t next_slot_;
+    std::atomic_uint32_t num_scatters_;
+    bool building_;
+
+    // Each render queue has its own timeline, since batches on different
+    // queues can finish out of order, but values are shared so they
+    // follow submission order.
+    DynArray<VkSemaphore> frame_timelines_;
+    uint64_t last_timeline_value_;
+    // Held while a submission publishes its timeline value and hands it
+    // to the notifier, and while the notifier is started, so it sees each
+    // batch exactly once
+    std::mutex notifier_lock_;
+
+    std::unique_ptr<ConfigState> cfg_state_;
 
-    int cur_batch_;
-    const int batch_mask_;
+    uint32_t cur_batch_;
 };
 
 }
@@ -9,6 +9,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -19,7 +20,7 @@ using namespace std;
 namespace bps3D {
 namespace vk {
 
-static FrustumBounds computeFrustumBounds(const glm::mat4 &proj)
+FrustumBounds computeFrustumBounds(const glm::mat4 &proj)
 {
     glm::mat4 t = glm::transpose(proj);
     glm::vec4 xplane = t[3] + t[0];
@@ -193,6 +194,90 @@ TextureData::~TextureData()
     dev.dt.freeMemory(dev.hdl, memory, nullptr);
 }
 
+struct StaticInstanceLayout {
+    uint32_t numInstances;
+    uint32_t numDraws;
+    VkDeviceSize transformOffset;
+    VkDeviceSize materialOffset;
+    VkDeviceSize drawInputOffset;
+    VkDeviceSize totalBytes;
+};
+
+static StaticInstanceLayout getStaticInstanceLayout(
+    const SceneLoadData &load_info,
+    const MemoryAllocator &alloc)
+{
+    const EnvironmentInit &env_init = load_info.envInit;
+
+    // The scene's arena holds nothing but the default instances
+    uint32_t num_instances = env_init.transforms.size();
+    uint32_t num_draws = 0;
+    for (uint32_t mesh_idx = 0; mesh_idx < load_info.meshInfo.size();
+         mesh_idx++) {
+        num_draws += env_init.ranges[mesh_idx].count *
+                     load_info.meshInfo[mesh_idx].numChunks;
+    }
+
+    // Descriptors can't cover empty ranges
+    uint32_t num_alloc_instances = max(num_instances, 1u);
+    uint32_t num_alloc_draws = max(num_draws, 1u);
+
+    StaticInstanceLayout layout;
+    layout.numInstances = num_instances;
+    layout.numDraws = num_draws;
+
+    layout.transformOffset =
+        alloc.alignStorageBufferOffset(load_info.hdr.totalBytes);
+    layout.materialOffset = alloc.alignStorageBufferOffset(
+        layout.transformOffset + sizeof(glm::mat4x3) * num_alloc_instances);
+    layout.drawInputOffset = alloc.alignStorageBufferOffset(
+        layout.materialOffset + sizeof(uint32_t) * num_alloc_instances);
+    layout.totalBytes =
+        layout.drawInputOffset + sizeof(DrawInput) * num_alloc_draws;
+
+    return layout;
+}
+
+static void stageStaticInstances(const SceneLoadData &load_info,
+                                 const StaticInstanceLayout &layout,
+                                 uint8_t *staging)
+{
+    const EnvironmentInit &env_init = load_info.envInit;
+
+    glm::mat4x3 *transform_ptr =
+        reinterpret_cast<glm::mat4x3 *>(staging + layout.transformOffset);
+    uint32_t *material_ptr =
+        reinterpret_cast<uint32_t *>(staging + layout.materialOffset);
+    DrawInput *draw_ptr =
+        reinterpret_cast<DrawInput *>(staging + layout.drawInputOffset);
+
+    memcpy(transform_ptr, env_init.transforms.data(),
+           sizeof(glm::mat4x3) * layout.numInstances);
+    memcpy(material_ptr, env_init.materials.data(),
+           sizeof(uint32_t) * layout.numInstances);
+
+    for (uint32_t mesh_idx = 0; mesh_idx < load_info.meshInfo.size();
+         mesh_idx++) {
+        const MeshInfo &mesh_info = load_info.meshInfo[mesh_idx];
+        const InstanceRange &range = env_init.ranges[mesh_idx];
+
+        for (uint32_t inst_idx = 0; inst_idx < range.count; inst_idx++) {
+            for (uint32_t chunk_idx = 0; chunk_idx < mesh_info.numChunks;
+                 chunk_idx++) {
+                uint32_t static_id = range.offset + inst_idx;
+
+                *draw_ptr++ = DrawInput {
+                    static_id | VulkanConfig::static_instance_flag,
+                    mesh_info.chunkOffset + chunk_idx,
+                };
+            }
+        }
+    }
+}
+
+// Starts at 1, render command caching uses sceneID 0 for inactive slots
+static atomic_uint64_t next_scene_id(1);
+
 shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
 {
     TextureData texture_store(dev, alloc);
@@ -271,9 +356,12 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         }
     }
 
-    // Copy all geometry into single buffer
+    StaticInstanceLayout static_layout =
+        getStaticInstanceLayout(load_info, alloc);
+
+    // Copy all geometry and static instances into single buffer
     optional<LocalBuffer> data_opt =
-        alloc.makeLocalBuffer(load_info.hdr.totalBytes);
+        alloc.makeLocalBuffer(static_layout.totalBytes);
 
     if (!data_opt.has_value()) {
         cerr << "Out of memory, failed to allocate geometry storage" << endl;
@@ -283,7 +371,7 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
     LocalBuffer data = move(data_opt.value());
 
     HostBuffer data_staging =
-        alloc.makeStagingBuffer(load_info.hdr.totalBytes);
+        alloc.makeStagingBuffer(static_layout.totalBytes);
 
     if (holds_alternative<ifstream>(load_info.data)) {
         ifstream &file = *get_if<ifstream>(&load_info.data);
@@ -293,6 +381,10 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         memcpy(data_staging.ptr, data_src, load_info.hdr.totalBytes);
     }
 
+    stageStaticInstances(load_info, static_layout,
+                         reinterpret_cast<uint8_t *>(data_staging.ptr));
+    data_staging.flush(dev);
+
     // Bind image memory and create views
     for (uint32_t i = 0; i < num_textures; i++) {
         LocalTexture &gpu_texture = gpu_textures[i];
@@ -327,7 +419,7 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
 
     // Copy vertex/index buffer onto GPU
     VkBufferCopy copy_settings {};
-    copy_settings.size = load_info.hdr.totalBytes;
+    copy_settings.size = static_layout.totalBytes;
     dev.dt.cmdCopyBuffer(transfer_stage_cmd_, data_staging.buffer, data.buffer,
                          1, &copy_settings);
 
@@ -433,18 +525,19 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         }
     }
 
-    // Transfer queue relinquish geometry
+    // Geometry is shared between queue families (see makeUnboundBuffer),
+    // so only needs its transfer writes made available
     VkBufferMemoryBarrier geometry_barrier;
     geometry_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
     geometry_barrier.pNext = nullptr;
     geometry_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
     geometry_barrier.dstAccessMask = 0;
-    geometry_barrier.srcQueueFamilyIndex = dev.transferQF;
-    geometry_barrier.dstQueueFamilyIndex = dev.gfxQF;
+    geometry_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    geometry_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 
     geometry_barrier.buffer = data.buffer;
     geometry_barrier.offset = 0;
-    geometry_barrier.size = load_info.hdr.totalBytes;
+    geometry_barrier.size = static_layout.totalBytes;
 
     // Geometry & texture barrier execute.
     dev.dt.cmdPipelineBarrier(
@@ -469,15 +562,18 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
     // Start recording for graphics queue
     REQ_VK(dev.dt.beginCommandBuffer(gfx_copy_cmd_, &begin_info));
 
-    // Finish moving geometry onto graphics queue family
+    // Make geometry visible to the graphics and compute queues
     // geometry and textures need separate barriers due to different
     // dependent stages
     geometry_barrier.srcAccessMask = 0;
-    geometry_barrier.dstAccessMask =
-        VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    geometry_barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                     VK_ACCESS_INDEX_READ_BIT |
+                                     VK_ACCESS_SHADER_READ_BIT;
 
     VkPipelineStageFlags dst_geo_gfx_stage =
-        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
 
     dev.dt.cmdPipelineBarrier(gfx_copy_cmd_, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
                               dst_geo_gfx_stage, 0, 0, nullptr, 1,
@@ -525,10 +621,18 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
     DescriptorSet cull_set = cull_desc_mgr_.makeSet();
     DescriptorSet draw_set = draw_desc_mgr_.makeSet();
 
-    DescriptorUpdates desc_updates(4);
+    DescriptorUpdates desc_updates(8);
+
+    VkDescriptorBufferInfo static_transform_info {
+        data.buffer,
+        static_layout.transformOffset,
+        static_layout.materialOffset - static_layout.transformOffset,
+    };
 
     // Cull Set Layout
     // 0: Mesh Chunks
+    // 1: Static transforms
+    // 2: Static draw inputs
 
     VkDescriptorBufferInfo chunk_buffer_info {
         data.buffer,
@@ -536,12 +640,22 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         load_info.hdr.numChunks * sizeof(MeshChunk),
     };
     desc_updates.storage(cull_set.hdl, &chunk_buffer_info, 0);
+    desc_updates.storage(cull_set.hdl, &static_transform_info, 1);
+
+    VkDescriptorBufferInfo static_input_info {
+        data.buffer,
+        static_layout.drawInputOffset,
+        static_layout.totalBytes - static_layout.drawInputOffset,
+    };
+    desc_updates.storage(cull_set.hdl, &static_input_info, 2);
 
     // Draw Set Layout
     // 0: Vertex buffer
     // 1: sampler
     // 2: textures
     // 3: material params
+    // 4: static transforms
+    // 5: static material indices
 
     VkDescriptorBufferInfo vertex_buffer_info {
         data.buffer,
@@ -549,11 +663,13 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         load_info.hdr.numVertices * sizeof(Vertex),
     };
     desc_updates.storage(draw_set.hdl, &vertex_buffer_info, 0);
+    desc_updates.storage(draw_set.hdl, &static_transform_info, 4);
 
     vector<VkDescriptorImageInfo> descriptor_views;
     descriptor_views.reserve(num_textures);
 
     VkDescriptorBufferInfo material_buffer_info;
+    VkDescriptorBufferInfo static_material_info;
     if (need_materials_) {
         for (int albedo_idx = 0; albedo_idx < (int)num_textures;
              albedo_idx++) {
@@ -573,6 +689,12 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         material_buffer_info.range =
             load_info.hdr.numMaterials * sizeof(MaterialParams);
         desc_updates.storage(draw_set.hdl, &material_buffer_info, 3);
+
+        static_material_info.buffer = data.buffer;
+        static_material_info.offset = static_layout.materialOffset;
+        static_material_info.range =
+            static_layout.drawInputOffset - static_layout.materialOffset;
+        desc_updates.storage(draw_set.hdl, &static_material_info, 5);
     }
 
     desc_updates.update(dev);
@@ -590,6 +712,9 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         move(data),
         load_info.hdr.indexOffset,
         num_meshes,
+        static_layout.numInstances,
+        static_layout.numDraws,
+        next_scene_id.fetch_add(1, memory_order_relaxed),
     });
 }
 
@@ -23,6 +23,9 @@ namespace vk {
 
 struct VulkanScene;
 
+// Culling planes of a symmetric perspective projection
+FrustumBounds computeFrustumBounds(const glm::mat4 &proj);
+
 struct VulkanEnvironment : public EnvironmentBackend {
     VulkanEnvironment(const Camera &cam, const VulkanScene &scene);
 
@@ -56,6 +59,14 @@ struct VulkanScene : public Scene {
     LocalBuffer data;
     VkDeviceSize indexOffset;
     uint32_t numMeshes;
+
+    // Default instances and their draw inputs, shared by every
+    // environment that hasn't modified them. Stored after the geometry.
+    uint32_t numStaticInstances;
+    uint32_t numStaticDraws;
+
+    // Process-unique, unlike the scene's address, which can be reused
+    uint64_t sceneID;
 };
 
 class VulkanLoader : public LoaderBackend {
@@ -22,7 +22,14 @@ using uint = uint32_t;
 using Shader::ViewInfo;
 using Shader::DrawPushConstant;
 using Shader::CullPushConstant;
+using Shader::CullEnvParams;
+using Shader::CullDispatchEnv;
+using Shader::ScatterPushConstant;
+using Shader::InstanceScatter;
 using Shader::DrawInput;
+using Shader::DrawCommand;
+using Shader::DrawRange;
+using Shader::ExpandPushConstant;
 using Shader::MeshCullInfo;
 using Shader::FrustumBounds;
 using Shader::PackedLight;
@@ -32,6 +39,10 @@ namespace VulkanConfig {
 constexpr uint32_t max_materials = MAX_MATERIALS;
 constexpr uint32_t max_lights = MAX_LIGHTS;
 constexpr uint32_t max_instances = 10000000;
+constexpr uint32_t max_instance_scatters = 262144;
+constexpr uint32_t max_draw_ranges = 1048576;
+constexpr uint32_t static_instance_flag = STATIC_INSTANCE_FLAG;
+constexpr uint32_t void_scatter_idx = VOID_SCATTER_IDX;
 constexpr uint32_t compute_workgroup_size = WORKGROUP_SIZE;
 
 }
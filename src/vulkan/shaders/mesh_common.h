@@ -1,21 +1,71 @@
 #ifndef BPS3D_VK_MESH_COMMON_H_INCLUDED
 #define BPS3D_VK_MESH_COMMON_H_INCLUDED
 
+// Set on instance IDs that refer to the scene's shared static instances
+#define STATIC_INSTANCE_FLAG (0x80000000u)
+
 struct DrawInput {
     uint instanceID;
     uint chunkID;
 };
 
+// Consecutive instances of one mesh, expanded on the GPU into one
+// DrawInput per instance per chunk, starting at firstDraw
+struct DrawRange {
+    uint firstDraw;
+    uint firstInstance;
+    uint numInstances;
+    uint chunkOffset;
+    uint numChunks;
+};
+
+struct ExpandPushConstant {
+    uint numRanges;
+    uint numDraws;
+};
+
 struct FrustumBounds {
     vec4 sides;
     vec2 nearFar;
 };
 
+// A cull dispatch covers a run of consecutive entries of the batch's
+// CullDispatchEnv table, all drawing the same scene. The run's draws are
+// compacted into a single list starting at baseDrawID, drawn by a single
+// indirect draw, and counted at the firstEnv entry of the count buffer.
 struct CullPushConstant {
-    FrustumBounds frustumBounds;
-    uint batchIdx;
+    uint firstEnv;
+    uint numEnvs;
     uint baseDrawID;
+};
+
+// Each env gets its own whole workgroups, starting at firstWorkgroup
+// within the dispatch, so no workgroup spans two envs
+struct CullDispatchEnv {
+    uint batchIdx;
+    uint firstWorkgroup;
+};
+
+// Per-environment culling parameters, rewritten every frame so recorded
+// command buffers don't depend on them
+struct CullEnvParams {
+    FrustumBounds frustumBounds;
     uint numDrawCommands;
+    uint baseInputID;
+    uint numStaticDraws;
+};
+
+// VkDrawIndexedIndirectCommand, followed by what the vertex shader needs
+// about the draw. firstInstance is the draw's own index, so the vertex
+// shader finds its command through gl_InstanceIndex.
+struct DrawCommand {
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    uint vertexOffset;
+    uint firstInstance;
+    uint instanceID;
+    uint batchIdx;
 };
 
 struct MeshCullInfo {
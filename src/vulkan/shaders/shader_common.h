@@ -8,8 +8,26 @@ struct ViewInfo {
     mat4 view;
 };
 
+// Layout of the mini batch's framebuffer layers, for placing each env's
+// output at its own image within them
 struct DrawPushConstant {
-    uint batchIdx;
+    uint numImagesWide;
+    uint numImagesTall;
+    uint numLayers;
+};
+
+// Instance index of queued scatters whose env is being uploaded whole
+// instead, which must not write anything
+#define VOID_SCATTER_IDX (0xFFFFFFFFu)
+
+struct ScatterPushConstant {
+    uint numUpdates;
+};
+
+struct InstanceScatter {
+    mat4x3 transform;
+    uint instanceIdx;
+    uint materialIdx;
 };
 
 struct PackedLight {
@@ -20,6 +20,10 @@ layout (location = 0) in InInterface {
 #ifdef OUTPUT_DEPTH
     float linearDepth;
 #endif
+
+#ifdef LIGHTING
+    flat uint batchIdx;
+#endif
 } iface;
 
 #ifdef OUTPUT_COLOR
@@ -37,10 +41,6 @@ layout (set = 0, binding = 0) readonly buffer ViewInfos {
     ViewInfo view_info[];
 };
 
-layout (push_constant, scalar) uniform PushConstant {
-    DrawPushConstant draw_const;
-};
-
 layout (set = 0, binding = 1, scalar) uniform LightingInfo {
     LightProperties lights[MAX_LIGHTS];
     uint numLights;
@@ -85,7 +85,7 @@ vec4 compute_color()
         vec3 world_light_position =
             lighting_info.lights[light_idx].position.xyz;
         vec3 light_position =
-                (view_info[draw_const.batchIdx].view *
+                (view_info[iface.batchIdx].view *
                     vec4(world_light_position, 1.f)).xyz;
         vec3 light_color = lighting_info.lights[light_idx].color.xyz;
         BRDFParams brdf_params = makeBRDFParams(light_position,
@@ -1,8 +1,10 @@
 #version 450
 #extension GL_EXT_scalar_block_layout : require
 #extension GL_GOOGLE_include_directive : require
+#extension GL_ARB_shader_viewport_layer_array : require
 
 #include "shader_common.h"
+#include "mesh_common.h"
 
 layout (location = 0) out OutInterface {
 #ifdef LIGHTING
@@ -18,6 +20,10 @@ layout (location = 0) out OutInterface {
 #ifdef OUTPUT_DEPTH
     float linearDepth;
 #endif
+
+#ifdef LIGHTING
+    flat uint batchIdx;
+#endif
 } iface;
 
 layout (set = 0, binding = 0) readonly buffer ViewInfos {
@@ -36,6 +42,10 @@ layout (set = 0, binding = 2) readonly buffer MatIndices {
 
 #endif
 
+layout (set = 0, binding = 4, scalar) readonly buffer DrawCommands {
+    DrawCommand drawCommands[];
+};
+
 layout (push_constant, scalar) uniform PushConstant {
     DrawPushConstant draw_const;
 };
@@ -44,14 +54,41 @@ layout (set = 1, binding = 0, scalar) readonly buffer Vertices {
     Vertex vertices[];
 };
 
+layout (set = 1, binding = 4, scalar) readonly buffer StaticTransforms {
+    mat4x3 staticTransforms[];
+};
+
+#ifdef MATERIALS
+
+layout (set = 1, binding = 5) readonly buffer StaticMatIndices {
+    uint staticMaterialIndices[];
+};
+
+#endif
+
 void main() 
 {
     Vertex v = vertices[gl_VertexIndex];
     vec4 object_space = vec4(v.px, v.py, v.pz, 1.f);
 
-    mat4 view = view_info[draw_const.batchIdx].view;
+    // firstInstance is the draw's index, its command carries the env's
+    // batch index and the instance ID, including the static flag
+    DrawCommand draw_cmd = drawCommands[gl_InstanceIndex];
+    uint batch_idx = draw_cmd.batchIdx;
+
+    mat4 view = view_info[batch_idx].view;
+
+    uint inst_id = draw_cmd.instanceID;
+    bool is_static = (inst_id & STATIC_INSTANCE_FLAG) != 0;
+    uint static_idx = inst_id & ~STATIC_INSTANCE_FLAG;
+
+    mat4x3 raw_txfm;
+    if (is_static) {
+        raw_txfm = staticTransforms[static_idx];
+    } else {
+        raw_txfm = transforms[inst_id];
+    }
 
-    mat4x3 raw_txfm = transforms[gl_InstanceIndex];
     mat4 model = mat4(raw_txfm[0], 0.f,
                       raw_txfm[1], 0.f,
                       raw_txfm[2], 0.f,
@@ -61,7 +98,29 @@ void main()
 
     vec4 camera_space = mv * object_space;
 
-    gl_Position = view_info[draw_const.batchIdx].projection * camera_space;
+    vec4 clip_pos = view_info[batch_idx].projection * camera_space;
+
+    // The viewport covers the whole layer, so scale the env's clip space
+    // down into its own image within it. Clipping against the image's
+    // edges happens before the remap, like the viewport clip would.
+    uint images_per_layer =
+        draw_const.numImagesWide * draw_const.numImagesTall;
+    uint image_idx = batch_idx % images_per_layer;
+    vec2 image_pos = vec2(image_idx % draw_const.numImagesWide,
+                          image_idx / draw_const.numImagesWide);
+    vec2 layer_images =
+        vec2(draw_const.numImagesWide, draw_const.numImagesTall);
+    vec2 image_center = (2.f * image_pos + 1.f) / layer_images - 1.f;
+
+    gl_ClipDistance[0] = clip_pos.w + clip_pos.x;
+    gl_ClipDistance[1] = clip_pos.w - clip_pos.x;
+    gl_ClipDistance[2] = clip_pos.w + clip_pos.y;
+    gl_ClipDistance[3] = clip_pos.w - clip_pos.y;
+
+    gl_Position = vec4(clip_pos.xy / layer_images +
+                           image_center * clip_pos.w,
+                       clip_pos.zw);
+    gl_Layer = int((batch_idx / images_per_layer) % draw_const.numLayers);
 
 #ifdef LIGHTING
     mat3 normal_mat = mat3(mv);
@@ -76,10 +135,18 @@ void main()
 
 #ifdef MATERIALS
     iface.uv = vec2(v.ux, v.uy);
-    iface.materialIndex = materialIndices[gl_InstanceIndex];
+    if (is_static) {
+        iface.materialIndex = staticMaterialIndices[static_idx];
+    } else {
+        iface.materialIndex = materialIndices[inst_id];
+    }
 #endif
 
 #ifdef OUTPUT_DEPTH
     iface.linearDepth = gl_Position.w;
 #endif
+
+#ifdef LIGHTING
+    iface.batchIdx = batch_idx;
+#endif
 }
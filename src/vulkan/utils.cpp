@@ -8,7 +8,7 @@ using namespace std;
 namespace bps3D {
 namespace vk {
 
-int exportBinarySemaphore(const DeviceState &dev, VkSemaphore semaphore)
+int exportSemaphore(const DeviceState &dev, VkSemaphore semaphore)
 {
     VkSemaphoreGetFdInfoKHR fd_info;
     fd_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
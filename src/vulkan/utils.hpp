@@ -47,7 +47,15 @@ inline VkQueue makeQueue(const DeviceState &dev,
 inline VkSemaphore makeBinarySemaphore(const DeviceState &dev);
 
 inline VkSemaphore makeBinaryExternalSemaphore(const DeviceState &dev);
-int exportBinarySemaphore(const DeviceState &dev, VkSemaphore semaphore);
+int exportSemaphore(const DeviceState &dev, VkSemaphore semaphore);
+
+inline VkSemaphore makeTimelineSemaphore(const DeviceState &dev,
+                                         uint64_t initial_value = 0);
+inline VkSemaphore makeTimelineExternalSemaphore(const DeviceState &dev);
+
+inline void waitForTimelineInfinitely(const DeviceState &dev,
+                                      VkSemaphore semaphore,
+                                      uint64_t value);
 
 inline VkFence makeFence(const DeviceState &dev, bool pre_signal = false);
 
@@ -135,6 +135,71 @@ VkSemaphore makeBinaryExternalSemaphore(const DeviceState &dev)
     return sema;
 }
 
+VkSemaphore makeTimelineSemaphore(const DeviceState &dev,
+                                  uint64_t initial_value)
+{
+    VkSemaphoreTypeCreateInfoKHR type_info;
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+    type_info.pNext = nullptr;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+    type_info.initialValue = initial_value;
+
+    VkSemaphoreCreateInfo sema_info;
+    sema_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    sema_info.pNext = &type_info;
+    sema_info.flags = 0;
+
+    VkSemaphore sema;
+    REQ_VK(dev.dt.createSemaphore(dev.hdl, &sema_info, nullptr, &sema));
+
+    return sema;
+}
+
+VkSemaphore makeTimelineExternalSemaphore(const DeviceState &dev)
+{
+    VkExportSemaphoreCreateInfo export_info;
+    export_info.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+    export_info.pNext = nullptr;
+    export_info.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+
+    VkSemaphoreTypeCreateInfoKHR type_info;
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+    type_info.pNext = &export_info;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+    type_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo sema_info;
+    sema_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    sema_info.pNext = &type_info;
+    sema_info.flags = 0;
+
+    VkSemaphore sema;
+    REQ_VK(dev.dt.createSemaphore(dev.hdl, &sema_info, nullptr, &sema));
+
+    return sema;
+}
+
+void waitForTimelineInfinitely(const DeviceState &dev,
+                               VkSemaphore semaphore,
+                               uint64_t value)
+{
+    VkSemaphoreWaitInfoKHR wait_info;
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+    wait_info.pNext = nullptr;
+    wait_info.flags = 0;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &semaphore;
+    wait_info.pValues = &value;
+
+    VkResult res;
+    while ((res = dev.dt.waitSemaphoresKHR(dev.hdl, &wait_info, ~0ull)) !=
+           VK_SUCCESS) {
+        if (res != VK_TIMEOUT) {
+            REQ_VK(res);
+        }
+    }
+}
+
 VkFence makeFence(const DeviceState &dev, bool pre_signal)
 {
     VkFenceCreateInfo fence_info;